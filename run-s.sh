@@ -1,3 +1,3 @@
 clang hello.S -c -o hello.o -target riscv32-unknown-linux-elf -march=rv32im -mabi=ilp32
-ld.lld hello.o -L$CDE_LIBRARY_PATH/riscv32 -lsysy -o hello
+ld.lld --relax-gp hello.o -L$CDE_LIBRARY_PATH/riscv32 -lsysy -o hello
 qemu-riscv32-static hello
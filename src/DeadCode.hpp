@@ -0,0 +1,292 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "IR.hpp"
+#include "ModRef.hpp"
+
+// 死代码删除. 从有副作用的指令出发标记用到的值, 没被标记的都删掉; 死存储删除用变量的
+// 活跃性, store 之后到下一次 store 之前不会再被 load 的值不用存
+
+// 删掉以后程序的行为不变吗: 分支, ret 和 store 要留着, call 只有可以提前执行 (不写变量,
+// 不做 I/O, 一定会返回) 的才能删
+static bool IsLiveRoot(koopa_raw_value_t inst, const ModRefAnalysis &modref) {
+  switch (inst->kind.tag) {
+    case KOOPA_RVT_BINARY:
+    case KOOPA_RVT_LOAD:
+    case KOOPA_RVT_ALLOC:
+      return false;
+    case KOOPA_RVT_CALL:
+      return !modref.Get(inst).Speculatable();
+    default:
+      return true;
+  }
+}
+
+static bool EliminateDeadCode(IRArena &arena, koopa_raw_function_t func,
+                              const ModRefAnalysis &modref) {
+  std::unordered_set<koopa_raw_value_t> live;
+  std::vector<koopa_raw_value_t> work;
+  for (size_t b = 0; b < func->bbs.len; b++) {
+    for (auto inst : Insts(SliceAt<koopa_raw_basic_block_t>(func->bbs, b))) {
+      if (IsLiveRoot(inst, modref) && live.insert(inst).second) {
+        work.push_back(inst);
+      }
+    }
+  }
+  while (!work.empty()) {
+    auto inst = work.back();
+    work.pop_back();
+    for (auto slot : OperandSlots(inst)) {
+      if (live.insert(*slot).second) {
+        work.push_back(*slot);
+      }
+    }
+  }
+  bool changed = false;
+  for (size_t b = 0; b < func->bbs.len; b++) {
+    auto bb = SliceAt<koopa_raw_basic_block_t>(func->bbs, b);
+    std::vector<koopa_raw_value_t> kept;
+    for (auto inst : Insts(bb)) {
+      if (live.count(inst)) {
+        kept.push_back(inst);
+      }
+    }
+    if (kept.size() != bb->insts.len) {
+      SetInsts(arena, bb, kept);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// 函数返回之后全局变量仍然可能被读到, call 会读它 (和它调用的函数) 读的全局变量
+static bool EliminateDeadStores(IRArena &arena, koopa_raw_function_t func,
+                                const ModRefAnalysis &modref) {
+  std::unordered_map<koopa_raw_value_t, size_t> index;
+  std::vector<koopa_raw_value_t> globals;
+  auto add_var = [&](koopa_raw_value_t var) {
+    if (index.emplace(var, index.size()).second && ModRefAnalysis::IsGlobal(var)) {
+      globals.push_back(var);
+    }
+  };
+  std::vector<koopa_raw_basic_block_t> blocks;
+  std::unordered_map<koopa_raw_basic_block_t, size_t> block_index;
+  for (size_t b = 0; b < func->bbs.len; b++) {
+    auto bb = SliceAt<koopa_raw_basic_block_t>(func->bbs, b);
+    block_index[bb] = blocks.size();
+    blocks.push_back(bb);
+    for (auto inst : Insts(bb)) {
+      if (inst->kind.tag == KOOPA_RVT_LOAD) {
+        add_var(inst->kind.data.load.src);
+      } else if (inst->kind.tag == KOOPA_RVT_STORE) {
+        add_var(inst->kind.data.store.dest);
+      }
+    }
+  }
+  // 从块尾往前走一遍, live 从块尾活跃的变量变成块首活跃的变量. dead 不为空时记录死掉的 store
+  auto transfer = [&](koopa_raw_basic_block_t bb, std::vector<bool> &live,
+                      std::unordered_set<koopa_raw_value_t> *dead) {
+    std::vector<koopa_raw_value_t> insts = Insts(bb);
+    for (auto it = insts.rbegin(); it != insts.rend(); ++it) {
+      auto inst = *it;
+      const auto &kind = inst->kind;
+      if (kind.tag == KOOPA_RVT_LOAD) {
+        live[index[kind.data.load.src]] = true;
+      } else if (kind.tag == KOOPA_RVT_STORE) {
+        size_t var = index[kind.data.store.dest];
+        if (!live[var] && dead) {
+          dead->insert(inst);
+        }
+        live[var] = false;
+      } else if (kind.tag == KOOPA_RVT_CALL) {
+        for (auto var : modref.Get(inst).reads) {
+          auto found = index.find(var);
+          if (found != index.end()) {
+            live[found->second] = true;
+          }
+        }
+      } else if (kind.tag == KOOPA_RVT_RETURN) {
+        for (auto var : globals) {
+          live[index[var]] = true;
+        }
+      }
+    }
+  };
+  std::vector<std::vector<bool>> live_in(blocks.size(), std::vector<bool>(index.size(), false));
+  auto live_out = [&](koopa_raw_basic_block_t bb) {
+    std::vector<bool> live(index.size(), false);
+    for (auto succ : Successors(bb)) {
+      const auto &in = live_in[block_index[succ]];
+      for (size_t v = 0; v < live.size(); v++) {
+        live[v] = live[v] || in[v];
+      }
+    }
+    return live;
+  };
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t b = blocks.size(); b-- > 0;) {
+      std::vector<bool> live = live_out(blocks[b]);
+      transfer(blocks[b], live, nullptr);
+      if (live != live_in[b]) {
+        live_in[b] = live;
+        changed = true;
+      }
+    }
+  }
+  std::unordered_set<koopa_raw_value_t> dead;
+  for (auto bb : blocks) {
+    std::vector<bool> live = live_out(bb);
+    transfer(bb, live, &dead);
+  }
+  if (dead.empty()) {
+    return false;
+  }
+  for (auto bb : blocks) {
+    std::vector<koopa_raw_value_t> kept;
+    for (auto inst : Insts(bb)) {
+      if (!dead.count(inst)) {
+        kept.push_back(inst);
+      }
+    }
+    if (kept.size() != bb->insts.len) {
+      SetInsts(arena, bb, kept);
+    }
+  }
+  return true;
+}
+
+// 从 main 出发调用不到的函数都删掉, 库函数的声明留着
+static bool RemoveDeadFunctions(IRArena &arena, koopa_raw_program_t &program) {
+  std::unordered_set<koopa_raw_function_t> reached;
+  std::vector<koopa_raw_function_t> work;
+  for (size_t f = 0; f < program.funcs.len; f++) {
+    auto func = SliceAt<koopa_raw_function_t>(program.funcs, f);
+    if (std::string(func->name) == "@main") {
+      reached.insert(func);
+      work.push_back(func);
+    }
+  }
+  if (work.empty()) {
+    return false;
+  }
+  while (!work.empty()) {
+    auto func = work.back();
+    work.pop_back();
+    for (size_t b = 0; b < func->bbs.len; b++) {
+      for (auto inst : Insts(SliceAt<koopa_raw_basic_block_t>(func->bbs, b))) {
+        if (inst->kind.tag != KOOPA_RVT_CALL) {
+          continue;
+        }
+        auto callee = inst->kind.data.call.callee;
+        if (reached.insert(callee).second) {
+          work.push_back(callee);
+        }
+      }
+    }
+  }
+  std::vector<const void *> kept;
+  for (size_t f = 0; f < program.funcs.len; f++) {
+    auto func = SliceAt<koopa_raw_function_t>(program.funcs, f);
+    if (func->bbs.len == 0 || reached.count(func)) {
+      kept.push_back(func);
+    }
+  }
+  if (kept.size() == program.funcs.len) {
+    return false;
+  }
+  program.funcs = arena.Slice(kept, KOOPA_RSIK_FUNCTION);
+  return true;
+}
+
+// 删掉函数里用不到的参数, 以及所有调用都不用的返回值, 同时改写所有调用. main 和库函数的签名
+// 不能改. 返回值删掉之后计算它的代码成了死代码, 可能又有参数用不到了, 所以重复到不再变化
+static bool RemoveDeadArguments(IRArena &arena, const koopa_raw_program_t &program,
+                                const ModRefAnalysis &modref) {
+  bool changed = false;
+  bool removed = true;
+  while (removed) {
+    removed = false;
+    std::unordered_set<koopa_raw_value_t> used;
+    std::unordered_map<koopa_raw_function_t, std::vector<koopa_raw_value_t>> calls;
+    for (size_t f = 0; f < program.funcs.len; f++) {
+      auto func = SliceAt<koopa_raw_function_t>(program.funcs, f);
+      for (size_t b = 0; b < func->bbs.len; b++) {
+        for (auto inst : Insts(SliceAt<koopa_raw_basic_block_t>(func->bbs, b))) {
+          for (auto slot : OperandSlots(inst)) {
+            used.insert(*slot);
+          }
+          if (inst->kind.tag == KOOPA_RVT_CALL) {
+            calls[inst->kind.data.call.callee].push_back(inst);
+          }
+        }
+      }
+    }
+    for (size_t f = 0; f < program.funcs.len; f++) {
+      auto func = SliceAt<koopa_raw_function_t>(program.funcs, f);
+      if (func->bbs.len == 0 || std::string(func->name) == "@main") {
+        continue;
+      }
+      const auto &ty = func->ty->data.function;
+      std::vector<bool> keep;
+      std::vector<const void *> params, param_types;
+      for (size_t i = 0; i < func->params.len; i++) {
+        auto param = SliceAt<koopa_raw_value_t>(func->params, i);
+        keep.push_back(used.count(param));
+        if (keep.back()) {
+          Mut(param)->kind.data.func_arg_ref.index = params.size();
+          params.push_back(param);
+          param_types.push_back(ty.params.buffer[i]);
+        }
+      }
+      const auto &sites = calls[func];
+      bool drop_ret = ty.ret->tag != KOOPA_RTT_UNIT &&
+                      std::none_of(sites.begin(), sites.end(),
+                                   [&](koopa_raw_value_t call) { return used.count(call); });
+      if (params.size() == func->params.len && !drop_ret) {
+        continue;
+      }
+      auto ret = drop_ret ? arena.Unit() : ty.ret;
+      auto mut = const_cast<koopa_raw_function_data_t *>(func);
+      mut->ty = arena.FunctionType(param_types, ret);
+      mut->params = arena.Slice(params, KOOPA_RSIK_VALUE);
+      for (auto call : sites) {
+        auto &args = Mut(call)->kind.data.call.args;
+        std::vector<const void *> kept;
+        for (size_t i = 0; i < args.len; i++) {
+          if (keep[i]) {
+            kept.push_back(args.buffer[i]);
+          }
+        }
+        args = arena.Slice(kept, KOOPA_RSIK_VALUE);
+        Mut(call)->ty = ret;
+      }
+      if (drop_ret) {
+        for (size_t b = 0; b < func->bbs.len; b++) {
+          auto bb = SliceAt<koopa_raw_basic_block_t>(func->bbs, b);
+          auto &kind = Mut(SliceAt<koopa_raw_value_t>(bb->insts, bb->insts.len - 1))->kind;
+          if (kind.tag == KOOPA_RVT_RETURN) {
+            kind.data.ret.value = nullptr;
+          }
+        }
+      }
+      removed = true;
+    }
+    if (removed) {
+      for (size_t f = 0; f < program.funcs.len; f++) {
+        auto func = SliceAt<koopa_raw_function_t>(program.funcs, f);
+        if (func->bbs.len != 0) {
+          EliminateDeadStores(arena, func, modref);
+          EliminateDeadCode(arena, func, modref);
+        }
+      }
+    }
+    changed |= removed;
+  }
+  return changed;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "IR.hpp"
+
+// 整个程序范围内的全局变量优化. 没有指针, 全局变量只能被 store 直接写到
+
+// 全局变量的初始值
+static int32_t InitialValue(koopa_raw_value_t var) {
+  auto init = var->kind.data.global_alloc.init;
+  return init->kind.tag == KOOPA_RVT_INTEGER ? init->kind.data.integer.value : 0;
+}
+
+// 程序里从来没被 store 过的全局变量其实是常量, 对它的 load 都换成初始值
+static bool PropagateConstantGlobals(IRArena &arena, const koopa_raw_program_t &program) {
+  std::unordered_set<koopa_raw_value_t> stored;
+  for (size_t f = 0; f < program.funcs.len; f++) {
+    auto func = SliceAt<koopa_raw_function_t>(program.funcs, f);
+    for (size_t b = 0; b < func->bbs.len; b++) {
+      for (auto inst : Insts(SliceAt<koopa_raw_basic_block_t>(func->bbs, b))) {
+        if (inst->kind.tag == KOOPA_RVT_STORE) {
+          stored.insert(inst->kind.data.store.dest);
+        }
+      }
+    }
+  }
+  bool changed = false;
+  for (size_t f = 0; f < program.funcs.len; f++) {
+    auto func = SliceAt<koopa_raw_function_t>(program.funcs, f);
+    std::unordered_map<koopa_raw_value_t, koopa_raw_value_t> replaced;
+    for (size_t b = 0; b < func->bbs.len; b++) {
+      for (auto inst : Insts(SliceAt<koopa_raw_basic_block_t>(func->bbs, b))) {
+        if (inst->kind.tag != KOOPA_RVT_LOAD) {
+          continue;
+        }
+        auto src = inst->kind.data.load.src;
+        if (src->kind.tag == KOOPA_RVT_GLOBAL_ALLOC && !stored.count(src)) {
+          replaced[inst] = arena.Integer(InitialValue(src));
+        }
+      }
+    }
+    ReplaceUses(func, replaced);
+    if (!replaced.empty()) {
+      RemoveUnusedValues(arena, func);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// 不再被任何指令引用的全局变量不用输出到 .data
+static bool RemoveUnusedGlobals(IRArena &arena, koopa_raw_program_t &program) {
+  std::unordered_set<koopa_raw_value_t> used;
+  for (size_t f = 0; f < program.funcs.len; f++) {
+    auto func = SliceAt<koopa_raw_function_t>(program.funcs, f);
+    for (size_t b = 0; b < func->bbs.len; b++) {
+      for (auto inst : Insts(SliceAt<koopa_raw_basic_block_t>(func->bbs, b))) {
+        for (auto slot : OperandSlots(inst)) {
+          used.insert(*slot);
+        }
+      }
+    }
+  }
+  std::vector<const void *> kept;
+  for (size_t i = 0; i < program.values.len; i++) {
+    auto value = SliceAt<koopa_raw_value_t>(program.values, i);
+    if (value->kind.tag != KOOPA_RVT_GLOBAL_ALLOC || used.count(value)) {
+      kept.push_back(value);
+    }
+  }
+  if (kept.size() == program.values.len) {
+    return false;
+  }
+  program.values = arena.Slice(kept, KOOPA_RSIK_VALUE);
+  return true;
+}
@@ -0,0 +1,537 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "koopa.h"
+
+// Koopa raw IR 上的优化共用的工具. raw program 里的结构都是 const 的, 优化直接
+// const_cast 之后原地修改; 优化新建的值和 slice 的内存由 IRArena 持有, 要和 raw program
+// 活得一样久. 优化过程中不维护 used_by, 全部优化结束后由 RebuildUsedBy 重新计算
+
+static koopa_raw_value_data_t *Mut(koopa_raw_value_t value) {
+  return const_cast<koopa_raw_value_data_t *>(value);
+}
+
+static koopa_raw_basic_block_data_t *Mut(koopa_raw_basic_block_t bb) {
+  return const_cast<koopa_raw_basic_block_data_t *>(bb);
+}
+
+template <typename T>
+static T SliceAt(const koopa_raw_slice_t &slice, size_t i) {
+  return reinterpret_cast<T>(slice.buffer[i]);
+}
+
+class IRArena {
+ public:
+  IRArena() {
+    int32_pointer_.tag = KOOPA_RTT_POINTER;
+    int32_pointer_.data.pointer.base = &int32_;
+  }
+
+  IRArena(const IRArena &) = delete;
+  IRArena &operator=(const IRArena &) = delete;
+
+  koopa_raw_slice_t Slice(const std::vector<const void *> &items, koopa_raw_slice_item_kind_t kind) {
+    buffers_.push_back(items);
+    auto &buffer = buffers_.back();
+    return koopa_raw_slice_t{.buffer = buffer.empty() ? nullptr : buffer.data(),
+                             .len = (uint32_t)buffer.size(),
+                             .kind = kind};
+  }
+
+  koopa_raw_value_data_t *NewValue(koopa_raw_type_t ty, koopa_raw_value_tag_t tag) {
+    values_.emplace_back();
+    koopa_raw_value_data_t *value = &values_.back();
+    value->ty = ty;
+    value->name = nullptr;
+    value->used_by = Slice({}, KOOPA_RSIK_VALUE);
+    value->kind.tag = tag;
+    return value;
+  }
+
+  koopa_raw_type_t Int32() const {
+    return &int32_;
+  }
+
+  koopa_raw_type_t Unit() const {
+    return &unit_;
+  }
+
+  // 新的 i32 局部变量
+  koopa_raw_value_t Alloc() {
+    return NewValue(&int32_pointer_, KOOPA_RVT_ALLOC);
+  }
+
+  koopa_raw_value_t Integer(int32_t n) {
+    auto value = NewValue(Int32(), KOOPA_RVT_INTEGER);
+    value->kind.data.integer.value = n;
+    return value;
+  }
+
+  koopa_raw_value_t Binary(koopa_raw_binary_op_t op, koopa_raw_value_t lhs,
+                           koopa_raw_value_t rhs) {
+    auto value = NewValue(Int32(), KOOPA_RVT_BINARY);
+    value->kind.data.binary.op = op;
+    value->kind.data.binary.lhs = lhs;
+    value->kind.data.binary.rhs = rhs;
+    return value;
+  }
+
+  koopa_raw_value_t Load(koopa_raw_value_t src) {
+    auto value = NewValue(Int32(), KOOPA_RVT_LOAD);
+    value->kind.data.load.src = src;
+    return value;
+  }
+
+  koopa_raw_value_t Store(koopa_raw_value_t value, koopa_raw_value_t dest) {
+    auto store = NewValue(Unit(), KOOPA_RVT_STORE);
+    store->kind.data.store.value = value;
+    store->kind.data.store.dest = dest;
+    return store;
+  }
+
+  koopa_raw_value_t Jump(koopa_raw_basic_block_t target) {
+    auto value = NewValue(Unit(), KOOPA_RVT_JUMP);
+    value->kind.data.jump.target = target;
+    value->kind.data.jump.args = Slice({}, KOOPA_RSIK_VALUE);
+    return value;
+  }
+
+  koopa_raw_value_t Branch(koopa_raw_value_t cond, koopa_raw_basic_block_t true_bb,
+                           koopa_raw_basic_block_t false_bb) {
+    auto value = NewValue(Unit(), KOOPA_RVT_BRANCH);
+    auto &branch = value->kind.data.branch;
+    branch.cond = cond;
+    branch.true_bb = true_bb;
+    branch.false_bb = false_bb;
+    branch.true_args = Slice({}, KOOPA_RSIK_VALUE);
+    branch.false_args = Slice({}, KOOPA_RSIK_VALUE);
+    return value;
+  }
+
+  koopa_raw_value_t Call(koopa_raw_function_t callee, const std::vector<const void *> &args) {
+    auto value = NewValue(callee->ty->data.function.ret, KOOPA_RVT_CALL);
+    value->kind.data.call.callee = callee;
+    value->kind.data.call.args = Slice(args, KOOPA_RSIK_VALUE);
+    return value;
+  }
+
+  koopa_raw_value_t Return(koopa_raw_value_t ret) {
+    auto value = NewValue(Unit(), KOOPA_RVT_RETURN);
+    value->kind.data.ret.value = ret;
+    return value;
+  }
+
+  // 新建的基本块没有名字, 后端会自己起名
+  koopa_raw_basic_block_data_t *NewBlock() {
+    blocks_.emplace_back();
+    koopa_raw_basic_block_data_t *bb = &blocks_.back();
+    bb->name = nullptr;
+    bb->params = Slice({}, KOOPA_RSIK_VALUE);
+    bb->used_by = Slice({}, KOOPA_RSIK_VALUE);
+    bb->insts = Slice({}, KOOPA_RSIK_VALUE);
+    return bb;
+  }
+
+  koopa_raw_type_t FunctionType(const std::vector<const void *> &params, koopa_raw_type_t ret) {
+    types_.emplace_back();
+    koopa_raw_type_kind_t *ty = &types_.back();
+    ty->tag = KOOPA_RTT_FUNCTION;
+    ty->data.function.params = Slice(params, KOOPA_RSIK_TYPE);
+    ty->data.function.ret = ret;
+    return ty;
+  }
+
+  koopa_raw_function_data_t *NewFunction(koopa_raw_type_t ty, const std::string &name) {
+    names_.push_back(name);
+    funcs_.emplace_back();
+    koopa_raw_function_data_t *func = &funcs_.back();
+    func->ty = ty;
+    func->name = names_.back().c_str();
+    func->params = Slice({}, KOOPA_RSIK_VALUE);
+    func->bbs = Slice({}, KOOPA_RSIK_BASIC_BLOCK);
+    return func;
+  }
+
+ private:
+  std::deque<koopa_raw_value_data_t> values_;
+  std::deque<koopa_raw_basic_block_data_t> blocks_;
+  std::deque<koopa_raw_function_data_t> funcs_;
+  std::deque<koopa_raw_type_kind_t> types_;
+  std::deque<std::string> names_;
+  std::deque<std::vector<const void *>> buffers_;
+  koopa_raw_type_kind_t int32_{.tag = KOOPA_RTT_INT32};
+  koopa_raw_type_kind_t unit_{.tag = KOOPA_RTT_UNIT};
+  koopa_raw_type_kind_t int32_pointer_;
+};
+
+static bool IsInteger(koopa_raw_value_t value) {
+  return value->kind.tag == KOOPA_RVT_INTEGER;
+}
+
+static bool IsInteger(koopa_raw_value_t value, int32_t n) {
+  return IsInteger(value) && value->kind.data.integer.value == n;
+}
+
+static bool IsCompare(const koopa_raw_value_t &value) {
+  if (value->kind.tag != KOOPA_RVT_BINARY) {
+    return false;
+  }
+  switch (value->kind.data.binary.op) {
+    case KOOPA_RBO_EQ:
+    case KOOPA_RBO_NOT_EQ:
+    case KOOPA_RBO_LT:
+    case KOOPA_RBO_GT:
+    case KOOPA_RBO_LE:
+    case KOOPA_RBO_GE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static koopa_raw_binary_op_t InvertCompare(koopa_raw_binary_op_t op) {
+  switch (op) {
+    case KOOPA_RBO_EQ: return KOOPA_RBO_NOT_EQ;
+    case KOOPA_RBO_NOT_EQ: return KOOPA_RBO_EQ;
+    case KOOPA_RBO_LT: return KOOPA_RBO_GE;
+    case KOOPA_RBO_GE: return KOOPA_RBO_LT;
+    case KOOPA_RBO_GT: return KOOPA_RBO_LE;
+    case KOOPA_RBO_LE: return KOOPA_RBO_GT;
+    default:
+      assert(false);
+      return op;
+  }
+}
+
+static std::vector<koopa_raw_basic_block_t> Successors(const koopa_raw_basic_block_t &bb) {
+  auto term = reinterpret_cast<koopa_raw_value_t>(bb->insts.buffer[bb->insts.len - 1]);
+  if (term->kind.tag == KOOPA_RVT_JUMP) {
+    return {term->kind.data.jump.target};
+  }
+  if (term->kind.tag == KOOPA_RVT_BRANCH) {
+    return {term->kind.data.branch.true_bb, term->kind.data.branch.false_bb};
+  }
+  return {};
+}
+
+// 交换操作数之后等价的比较
+static koopa_raw_binary_op_t SwapCompare(koopa_raw_binary_op_t op) {
+  switch (op) {
+    case KOOPA_RBO_LT: return KOOPA_RBO_GT;
+    case KOOPA_RBO_GT: return KOOPA_RBO_LT;
+    case KOOPA_RBO_LE: return KOOPA_RBO_GE;
+    case KOOPA_RBO_GE: return KOOPA_RBO_LE;
+    default:
+      return op;
+  }
+}
+
+// 按 SysY 的语义 (32 位补码, 溢出回绕) 计算 a op b. 除以 0 没有定义, 不能折叠
+static bool FoldBinary(koopa_raw_binary_op_t op, int32_t a, int32_t b, int32_t &result) {
+  uint32_t ua = a, ub = b;
+  switch (op) {
+    case KOOPA_RBO_NOT_EQ: result = a != b; return true;
+    case KOOPA_RBO_EQ: result = a == b; return true;
+    case KOOPA_RBO_GT: result = a > b; return true;
+    case KOOPA_RBO_LT: result = a < b; return true;
+    case KOOPA_RBO_GE: result = a >= b; return true;
+    case KOOPA_RBO_LE: result = a <= b; return true;
+    case KOOPA_RBO_ADD: result = (int32_t)(ua + ub); return true;
+    case KOOPA_RBO_SUB: result = (int32_t)(ua - ub); return true;
+    case KOOPA_RBO_MUL: result = (int32_t)(ua * ub); return true;
+    case KOOPA_RBO_DIV:
+    case KOOPA_RBO_MOD:
+      if (b == 0) {
+        return false;
+      }
+      // INT_MIN / -1 溢出, 和 RISC-V 的 div/rem 一样得到 INT_MIN 和 0
+      if (a == INT32_MIN && b == -1) {
+        result = op == KOOPA_RBO_DIV ? INT32_MIN : 0;
+      } else {
+        result = op == KOOPA_RBO_DIV ? a / b : a % b;
+      }
+      return true;
+    case KOOPA_RBO_AND: result = a & b; return true;
+    case KOOPA_RBO_OR: result = a | b; return true;
+    case KOOPA_RBO_XOR: result = a ^ b; return true;
+    case KOOPA_RBO_SHL: result = (int32_t)(ua << (ub & 31)); return true;
+    case KOOPA_RBO_SHR: result = (int32_t)(ua >> (ub & 31)); return true;
+    case KOOPA_RBO_SAR: result = a >> (ub & 31); return true;
+    default:
+      return false;
+  }
+}
+
+// 指令里所有读取值的操作数位置, 可以直接改写
+static std::vector<koopa_raw_value_t *> OperandSlots(koopa_raw_value_t inst) {
+  auto &kind = Mut(inst)->kind;
+  switch (kind.tag) {
+    case KOOPA_RVT_BINARY:
+      return {&kind.data.binary.lhs, &kind.data.binary.rhs};
+    case KOOPA_RVT_LOAD:
+      return {&kind.data.load.src};
+    case KOOPA_RVT_STORE:
+      return {&kind.data.store.value, &kind.data.store.dest};
+    case KOOPA_RVT_BRANCH:
+      return {&kind.data.branch.cond};
+    case KOOPA_RVT_RETURN:
+      if (kind.data.ret.value) {
+        return {&kind.data.ret.value};
+      }
+      return {};
+    case KOOPA_RVT_CALL: {
+      std::vector<koopa_raw_value_t *> slots;
+      auto &args = kind.data.call.args;
+      for (size_t i = 0; i < args.len; i++) {
+        slots.push_back(reinterpret_cast<koopa_raw_value_t *>(&args.buffer[i]));
+      }
+      return slots;
+    }
+    default:
+      return {};
+  }
+}
+
+static std::vector<koopa_raw_value_t> Insts(koopa_raw_basic_block_t bb) {
+  std::vector<koopa_raw_value_t> insts;
+  for (size_t i = 0; i < bb->insts.len; i++) {
+    insts.push_back(SliceAt<koopa_raw_value_t>(bb->insts, i));
+  }
+  return insts;
+}
+
+static void SetInsts(IRArena &arena, koopa_raw_basic_block_t bb,
+                     const std::vector<koopa_raw_value_t> &insts) {
+  Mut(bb)->insts = arena.Slice(std::vector<const void *>(insts.begin(), insts.end()),
+                               KOOPA_RSIK_VALUE);
+}
+
+// 把函数里对 replaced 中的值的使用改成对应的新值 (新值本身也可能被替换)
+static void ReplaceUses(koopa_raw_function_t func,
+                        const std::unordered_map<koopa_raw_value_t, koopa_raw_value_t> &replaced) {
+  if (replaced.empty()) {
+    return;
+  }
+  for (size_t b = 0; b < func->bbs.len; b++) {
+    for (auto inst : Insts(SliceAt<koopa_raw_basic_block_t>(func->bbs, b))) {
+      for (auto slot : OperandSlots(inst)) {
+        for (auto it = replaced.find(*slot); it != replaced.end(); it = replaced.find(*slot)) {
+          *slot = it->second;
+        }
+      }
+    }
+  }
+}
+
+// 有结果且没有副作用的指令, 结果不被使用时可以直接删掉
+static bool IsPure(koopa_raw_value_t inst) {
+  return inst->kind.tag == KOOPA_RVT_BINARY || inst->kind.tag == KOOPA_RVT_LOAD;
+}
+
+// 删掉函数里结果不被使用的纯指令, 直到不再有可删的为止
+static bool RemoveUnusedValues(IRArena &arena, koopa_raw_function_t func) {
+  bool changed = false;
+  bool removed = true;
+  while (removed) {
+    removed = false;
+    std::unordered_map<koopa_raw_value_t, int> uses;
+    for (size_t b = 0; b < func->bbs.len; b++) {
+      for (auto inst : Insts(SliceAt<koopa_raw_basic_block_t>(func->bbs, b))) {
+        for (auto slot : OperandSlots(inst)) {
+          uses[*slot]++;
+        }
+      }
+    }
+    for (size_t b = 0; b < func->bbs.len; b++) {
+      auto bb = SliceAt<koopa_raw_basic_block_t>(func->bbs, b);
+      std::vector<koopa_raw_value_t> kept;
+      for (auto inst : Insts(bb)) {
+        if (IsPure(inst) && !uses.count(inst)) {
+          removed = true;
+          continue;
+        }
+        kept.push_back(inst);
+      }
+      if (kept.size() != bb->insts.len) {
+        SetInsts(arena, bb, kept);
+      }
+    }
+    changed |= removed;
+  }
+  return changed;
+}
+
+// 按当前的指令重新计算所有值和基本块的 used_by, 后端靠它判断一个值被用了几次
+static void RebuildUsedBy(IRArena &arena, const koopa_raw_program_t &program) {
+  std::unordered_map<koopa_raw_value_t, std::vector<const void *>> value_users;
+  std::unordered_map<koopa_raw_basic_block_t, std::vector<const void *>> block_users;
+  std::vector<koopa_raw_value_t> values;
+  std::vector<koopa_raw_basic_block_t> blocks;
+  for (size_t i = 0; i < program.values.len; i++) {
+    values.push_back(SliceAt<koopa_raw_value_t>(program.values, i));
+  }
+  for (size_t f = 0; f < program.funcs.len; f++) {
+    auto func = SliceAt<koopa_raw_function_t>(program.funcs, f);
+    for (size_t i = 0; i < func->params.len; i++) {
+      values.push_back(SliceAt<koopa_raw_value_t>(func->params, i));
+    }
+    for (size_t b = 0; b < func->bbs.len; b++) {
+      auto bb = SliceAt<koopa_raw_basic_block_t>(func->bbs, b);
+      blocks.push_back(bb);
+      for (auto inst : Insts(bb)) {
+        values.push_back(inst);
+        for (auto slot : OperandSlots(inst)) {
+          values.push_back(*slot);
+          value_users[*slot].push_back(inst);
+        }
+        if (inst->kind.tag == KOOPA_RVT_BRANCH) {
+          block_users[inst->kind.data.branch.true_bb].push_back(inst);
+          block_users[inst->kind.data.branch.false_bb].push_back(inst);
+        } else if (inst->kind.tag == KOOPA_RVT_JUMP) {
+          block_users[inst->kind.data.jump.target].push_back(inst);
+        }
+      }
+    }
+  }
+  for (auto value : values) {
+    Mut(value)->used_by = arena.Slice(value_users[value], KOOPA_RSIK_VALUE);
+  }
+  for (auto bb : blocks) {
+    Mut(bb)->used_by = arena.Slice(block_users[bb], KOOPA_RSIK_VALUE);
+  }
+}
+
+// 每个块的前驱个数, 没有前驱的块也在里面
+static std::unordered_map<koopa_raw_basic_block_t, int> PredecessorCounts(
+    koopa_raw_function_t func) {
+  std::unordered_map<koopa_raw_basic_block_t, int> preds;
+  for (size_t b = 0; b < func->bbs.len; b++) {
+    auto bb = SliceAt<koopa_raw_basic_block_t>(func->bbs, b);
+    preds[bb];
+    for (auto succ : Successors(bb)) {
+      preds[succ]++;
+    }
+  }
+  return preds;
+}
+
+// bb 里定义的值在别的块里被使用
+static bool ValuesEscape(koopa_raw_function_t func, koopa_raw_basic_block_t bb) {
+  std::vector<koopa_raw_value_t> insts = Insts(bb);
+  std::unordered_set<koopa_raw_value_t> defs(insts.begin(), insts.end());
+  for (size_t b = 0; b < func->bbs.len; b++) {
+    auto other = SliceAt<koopa_raw_basic_block_t>(func->bbs, b);
+    if (other == bb) {
+      continue;
+    }
+    for (auto inst : Insts(other)) {
+      for (auto slot : OperandSlots(inst)) {
+        if (defs.count(*slot)) {
+          return true;
+        }
+      }
+    }
+  }
+  return false;
+}
+
+// 把新建的块加到函数末尾
+static void AddBlocks(IRArena &arena, koopa_raw_function_t func,
+                      const std::vector<koopa_raw_basic_block_t> &blocks) {
+  std::vector<const void *> bbs;
+  for (size_t b = 0; b < func->bbs.len; b++) {
+    bbs.push_back(func->bbs.buffer[b]);
+  }
+  bbs.insert(bbs.end(), blocks.begin(), blocks.end());
+  const_cast<koopa_raw_function_data_t *>(func)->bbs = arena.Slice(bbs, KOOPA_RSIK_BASIC_BLOCK);
+}
+
+// 删掉从入口不可达的基本块
+static bool RemoveUnreachableBlocks(IRArena &arena, koopa_raw_function_t func) {
+  std::unordered_set<koopa_raw_basic_block_t> reached;
+  std::vector<koopa_raw_basic_block_t> work = {SliceAt<koopa_raw_basic_block_t>(func->bbs, 0)};
+  while (!work.empty()) {
+    auto bb = work.back();
+    work.pop_back();
+    if (reached.insert(bb).second) {
+      for (auto succ : Successors(bb)) {
+        work.push_back(succ);
+      }
+    }
+  }
+  if (reached.size() == func->bbs.len) {
+    return false;
+  }
+  std::vector<const void *> kept;
+  for (size_t b = 0; b < func->bbs.len; b++) {
+    auto bb = SliceAt<koopa_raw_basic_block_t>(func->bbs, b);
+    if (reached.count(bb)) {
+      kept.push_back(bb);
+    }
+  }
+  const_cast<koopa_raw_function_data_t *>(func)->bbs = arena.Slice(kept, KOOPA_RSIK_BASIC_BLOCK);
+  return true;
+}
+
+// 从入口可达的基本块的逆后序, 除了回边, 每个块都排在它的前驱之后
+static std::vector<koopa_raw_basic_block_t> ReversePostOrder(koopa_raw_function_t func) {
+  std::vector<koopa_raw_basic_block_t> order;
+  std::unordered_set<koopa_raw_basic_block_t> visited;
+  std::vector<std::pair<koopa_raw_basic_block_t, size_t>> stack;
+  auto entry = SliceAt<koopa_raw_basic_block_t>(func->bbs, 0);
+  visited.insert(entry);
+  stack.push_back({entry, 0});
+  while (!stack.empty()) {
+    auto &[bb, k] = stack.back();
+    auto succs = Successors(bb);
+    if (k == succs.size()) {
+      order.push_back(bb);
+      stack.pop_back();
+      continue;
+    }
+    auto succ = succs[k++];
+    if (visited.insert(succ).second) {
+      stack.push_back({succ, 0});
+    }
+  }
+  return std::vector<koopa_raw_basic_block_t>(order.rbegin(), order.rend());
+}
+
+// 以 jump 结尾的块和它唯一前驱的后继合并成一个块, 块内的优化可以看到更长的指令序列
+static bool MergeBlocks(IRArena &arena, koopa_raw_function_t func) {
+  std::unordered_map<koopa_raw_basic_block_t, int> preds = PredecessorCounts(func);
+  auto entry = SliceAt<koopa_raw_basic_block_t>(func->bbs, 0);
+  bool changed = false;
+  for (size_t b = 0; b < func->bbs.len; b++) {
+    auto bb = SliceAt<koopa_raw_basic_block_t>(func->bbs, b);
+    while (true) {
+      auto term = SliceAt<koopa_raw_value_t>(bb->insts, bb->insts.len - 1);
+      if (term->kind.tag != KOOPA_RVT_JUMP) {
+        break;
+      }
+      auto next = term->kind.data.jump.target;
+      if (next == bb || next == entry || preds[next] != 1) {
+        break;
+      }
+      std::vector<koopa_raw_value_t> insts = Insts(bb);
+      insts.pop_back();
+      for (auto inst : Insts(next)) {
+        insts.push_back(inst);
+      }
+      SetInsts(arena, bb, insts);
+      // next 不再可达, 它的后继的前驱变成了 bb, 个数不变
+      preds[next] = 0;
+      changed = true;
+    }
+  }
+  if (changed) {
+    RemoveUnreachableBlocks(arena, func);
+  }
+  return changed;
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "IR.hpp"
+#include "Schedule.hpp"
+
+// if-conversion: 只有简单赋值的小菱形 (以及只有一边的三角形)
+//   B: br c, T, F    T: ...; store x, @v; jump J    F: ...; store y, @v; jump J
+// 改成在 B 里把两边都算出来, 再用掩码选择: v = y + ((x - y) & (0 - c)), 然后直接 jump J.
+// 两边只能有 load, 不含 div/mod 的 binary 和对变量的 store, 提前执行它们没有副作用.
+// 是否转换由分支代价模型决定: 数据相关的分支按一半的概率预测失败估计
+
+static const size_t kMaxArmInsts = 8;
+
+// 一边分支: 可以提前到 B 里执行的计算, 以及按顺序 store 的 (变量, 值)
+struct IfArm {
+  std::vector<koopa_raw_value_t> compute;
+  std::vector<std::pair<koopa_raw_value_t, koopa_raw_value_t>> stores;
+
+  koopa_raw_value_t StoredValue(koopa_raw_value_t var) const {
+    for (const auto &[v, value] : stores) {
+      if (v == var) {
+        return value;
+      }
+    }
+    return nullptr;
+  }
+};
+
+static bool IsVariable(koopa_raw_value_t value) {
+  return value->kind.tag == KOOPA_RVT_ALLOC || value->kind.tag == KOOPA_RVT_GLOBAL_ALLOC;
+}
+
+// bb 以 jump join 结尾, 其余的指令都能提前执行时返回 true. 同一个变量只能 store 一次,
+// 且 store 之后不能再 load, 这样所有 load 都读到的是进入分支之前的值
+static bool CollectArm(koopa_raw_basic_block_t bb, koopa_raw_basic_block_t join, IfArm &arm) {
+  std::vector<koopa_raw_value_t> insts = Insts(bb);
+  auto term = insts.back();
+  if (term->kind.tag != KOOPA_RVT_JUMP || term->kind.data.jump.target != join ||
+      insts.size() - 1 > kMaxArmInsts) {
+    return false;
+  }
+  for (size_t i = 0; i + 1 < insts.size(); i++) {
+    auto inst = insts[i];
+    const auto &kind = inst->kind;
+    switch (kind.tag) {
+      case KOOPA_RVT_LOAD:
+        if (!IsVariable(kind.data.load.src) || arm.StoredValue(kind.data.load.src)) {
+          return false;
+        }
+        arm.compute.push_back(inst);
+        break;
+      case KOOPA_RVT_BINARY:
+        if (kind.data.binary.op == KOOPA_RBO_DIV || kind.data.binary.op == KOOPA_RBO_MOD) {
+          return false;
+        }
+        arm.compute.push_back(inst);
+        break;
+      case KOOPA_RVT_STORE:
+        if (!IsVariable(kind.data.store.dest) || arm.StoredValue(kind.data.store.dest)) {
+          return false;
+        }
+        arm.stores.push_back({kind.data.store.dest, kind.data.store.value});
+        break;
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
+// 在 B 里提前执行一边的代价. B 里已经读写过的变量再 load 会被块内转发掉, 不算代价
+static int ArmCost(const IfArm &arm, const std::unordered_set<koopa_raw_value_t> &available,
+                   const CpuModel &cpu) {
+  int cost = 0;
+  for (auto inst : arm.compute) {
+    if (inst->kind.tag == KOOPA_RVT_LOAD) {
+      cost += available.count(inst->kind.data.load.src) ? 0 : 1;
+    } else {
+      cost += inst->kind.data.binary.op == KOOPA_RBO_MUL ? cpu.mul : cpu.alu;
+    }
+  }
+  return cost;
+}
+
+static bool IfConvertBlock(IRArena &arena, koopa_raw_function_t func, koopa_raw_basic_block_t bb,
+                           const std::unordered_map<koopa_raw_basic_block_t, int> &preds,
+                           const CpuModel &cpu) {
+  std::vector<koopa_raw_value_t> insts = Insts(bb);
+  auto term = insts.back();
+  if (term->kind.tag != KOOPA_RVT_BRANCH) {
+    return false;
+  }
+  const auto &branch = term->kind.data.branch;
+  auto t = branch.true_bb, f = branch.false_bb;
+  if (t == f || t == bb || f == bb) {
+    return false;
+  }
+  auto single_pred = [&](koopa_raw_basic_block_t x) { return preds.at(x) == 1; };
+  IfArm arm_t, arm_f;
+  koopa_raw_basic_block_t join = nullptr;
+  std::vector<koopa_raw_basic_block_t> arms;
+  if (single_pred(t) && CollectArm(t, f, arm_t)) {
+    // 三角形, 只有 true 一边
+    join = f;
+    arms = {t};
+  } else if (single_pred(f) && CollectArm(f, t, arm_f = IfArm())) {
+    arm_t = IfArm();
+    join = t;
+    arms = {f};
+  } else {
+    arm_t = arm_f = IfArm();
+    auto t_term = SliceAt<koopa_raw_value_t>(t->insts, t->insts.len - 1);
+    if (!single_pred(t) || !single_pred(f) || t_term->kind.tag != KOOPA_RVT_JUMP) {
+      return false;
+    }
+    join = t_term->kind.data.jump.target;
+    if (join == bb || join == t || join == f || !CollectArm(t, join, arm_t) ||
+        !CollectArm(f, join, arm_f)) {
+      return false;
+    }
+    arms = {t, f};
+  }
+  for (auto arm : arms) {
+    if (ValuesEscape(func, arm)) {
+      return false;
+    }
+  }
+
+  // 被赋值的变量, 只在一边赋值的变量另一边保持原来的值
+  std::vector<koopa_raw_value_t> vars;
+  for (const IfArm *arm : {&arm_t, &arm_f}) {
+    for (const auto &[var, value] : arm->stores) {
+      if (std::find(vars.begin(), vars.end(), var) == vars.end()) {
+        vars.push_back(var);
+      }
+    }
+  }
+  std::unordered_set<koopa_raw_value_t> available;
+  for (auto inst : insts) {
+    if (inst->kind.tag == KOOPA_RVT_LOAD) {
+      available.insert(inst->kind.data.load.src);
+    } else if (inst->kind.tag == KOOPA_RVT_STORE) {
+      available.insert(inst->kind.data.store.dest);
+    }
+  }
+  int arm_cost = ArmCost(arm_t, available, cpu) + ArmCost(arm_f, available, cpu);
+  int old_loads = 0;
+  for (auto var : vars) {
+    if ((!arm_t.StoredValue(var) || !arm_f.StoredValue(var)) && !available.count(var)) {
+      old_loads++;
+    }
+  }
+  // 分支: br + j, 一半的概率预测失败, 平均执行一边.
+  // 无分支: 两边都执行, 比较的结果要放进寄存器 (原来和 br 融合), 一个掩码, 每个变量 3 条
+  int branchless = arm_cost + old_loads + 1 + 1 + 3 * (int)vars.size();
+  if (2 * branchless > 4 + arm_cost + cpu.branch_miss) {
+    return false;
+  }
+
+  insts.pop_back();
+  insts.insert(insts.end(), arm_t.compute.begin(), arm_t.compute.end());
+  insts.insert(insts.end(), arm_f.compute.begin(), arm_f.compute.end());
+  koopa_raw_value_t cond = branch.cond;
+  if (!IsCompare(cond)) {
+    cond = arena.Binary(KOOPA_RBO_NOT_EQ, cond, arena.Integer(0));
+    insts.push_back(cond);
+  }
+  auto mask = arena.Binary(KOOPA_RBO_SUB, arena.Integer(0), cond);
+  insts.push_back(mask);
+  std::vector<koopa_raw_value_t> stores;
+  for (auto var : vars) {
+    koopa_raw_value_t x = arm_t.StoredValue(var), y = arm_f.StoredValue(var);
+    if (!x || !y) {
+      auto old = arena.Load(var);
+      insts.push_back(old);
+      x = x ? x : old;
+      y = y ? y : old;
+    }
+    auto diff = arena.Binary(KOOPA_RBO_SUB, x, y);
+    auto masked = arena.Binary(KOOPA_RBO_AND, diff, mask);
+    auto select = arena.Binary(KOOPA_RBO_ADD, y, masked);
+    insts.insert(insts.end(), {diff, masked, select});
+    stores.push_back(arena.Store(select, var));
+  }
+  // 先读完所有旧值再写
+  insts.insert(insts.end(), stores.begin(), stores.end());
+  insts.push_back(arena.Jump(join));
+  SetInsts(arena, bb, insts);
+  return true;
+}
+
+static bool IfConvertFunction(IRArena &arena, koopa_raw_function_t func, const CpuModel &cpu) {
+  bool changed = false;
+  bool converted = true;
+  // 内层的 if 变成一个块之后, 外层的 if 可能也能转换
+  while (converted) {
+    converted = false;
+    std::unordered_map<koopa_raw_basic_block_t, int> preds = PredecessorCounts(func);
+    for (size_t b = 0; b < func->bbs.len && !converted; b++) {
+      converted = IfConvertBlock(arena, func, SliceAt<koopa_raw_basic_block_t>(func->bbs, b),
+                                 preds, cpu);
+    }
+    if (converted) {
+      RemoveUnreachableBlocks(arena, func);
+      changed = true;
+    }
+  }
+  return changed;
+}
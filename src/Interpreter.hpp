@@ -0,0 +1,261 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "Globals.hpp"
+#include "IR.hpp"
+#include "ModRef.hpp"
+
+// 编译期解释执行 Koopa IR. 参数都是常量的纯函数调用直接算出结果; 不读输入的整个程序在编译
+// 期跑完, main 只剩下按顺序输出算好的常量. 执行的指令数, 调用深度和输出的次数都有上限,
+// 超过上限, 读输入, 除以 0 时放弃, 程序保持原样
+
+// 折叠一次函数调用最多执行的指令数
+static const size_t kMaxCallEvalSteps = 100000;
+// 解释整个程序最多执行的指令数
+static const size_t kMaxProgramEvalSteps = 5000000;
+static const int kMaxEvalDepth = 1000;
+// 整个程序折叠后最多保留的输出调用
+static const size_t kMaxEvalOutputs = 1024;
+
+class Interpreter {
+ public:
+  // 执行中调用的库函数: 只有输出和计时的函数可以留到运行时按顺序执行
+  struct Output {
+    koopa_raw_function_t callee;
+    std::vector<int32_t> args;
+  };
+
+  Interpreter(size_t max_steps, bool allow_output)
+      : steps_(max_steps), allow_output_(allow_output) {}
+
+  bool Call(koopa_raw_function_t func, const std::vector<int32_t> &args, int32_t &result) {
+    return Run(func, args, result, 0);
+  }
+
+  const std::vector<Output> &Outputs() const {
+    return outputs_;
+  }
+
+ private:
+  // 没有名字的值 (参数, 指令的结果) 和 alloc 的内容都放在 frame 里
+  using Frame = std::unordered_map<koopa_raw_value_t, int32_t>;
+
+  bool Run(koopa_raw_function_t func, const std::vector<int32_t> &args, int32_t &result,
+           int depth) {
+    if (func->bbs.len == 0) {
+      return Library(func, args, result);
+    }
+    if (depth > kMaxEvalDepth) {
+      return false;
+    }
+    Frame frame;
+    auto get = [&](koopa_raw_value_t value) -> int32_t {
+      if (value->kind.tag == KOOPA_RVT_INTEGER) {
+        return value->kind.data.integer.value;
+      }
+      if (value->kind.tag == KOOPA_RVT_FUNC_ARG_REF) {
+        return args[value->kind.data.func_arg_ref.index];
+      }
+      return frame[value];
+    };
+    auto bb = SliceAt<koopa_raw_basic_block_t>(func->bbs, 0);
+    while (true) {
+      koopa_raw_basic_block_t next = nullptr;
+      for (size_t i = 0; i < bb->insts.len && !next; i++) {
+        if (steps_ == 0) {
+          return false;
+        }
+        steps_--;
+        auto inst = SliceAt<koopa_raw_value_t>(bb->insts, i);
+        const auto &kind = inst->kind;
+        switch (kind.tag) {
+          case KOOPA_RVT_ALLOC:
+            frame[inst] = 0;
+            break;
+          case KOOPA_RVT_LOAD: {
+            auto src = kind.data.load.src;
+            frame[inst] = ModRefAnalysis::IsGlobal(src) ? Global(src) : frame[src];
+            break;
+          }
+          case KOOPA_RVT_STORE: {
+            auto dest = kind.data.store.dest;
+            int32_t value = get(kind.data.store.value);
+            if (ModRefAnalysis::IsGlobal(dest)) {
+              Global(dest) = value;
+            } else {
+              frame[dest] = value;
+            }
+            break;
+          }
+          case KOOPA_RVT_BINARY: {
+            const auto &bin = kind.data.binary;
+            if (!FoldBinary(bin.op, get(bin.lhs), get(bin.rhs), frame[inst])) {
+              return false;
+            }
+            break;
+          }
+          case KOOPA_RVT_CALL: {
+            std::vector<int32_t> call_args;
+            for (size_t a = 0; a < kind.data.call.args.len; a++) {
+              call_args.push_back(get(SliceAt<koopa_raw_value_t>(kind.data.call.args, a)));
+            }
+            if (!Run(kind.data.call.callee, call_args, frame[inst], depth + 1)) {
+              return false;
+            }
+            break;
+          }
+          case KOOPA_RVT_BRANCH:
+            next = get(kind.data.branch.cond) ? kind.data.branch.true_bb
+                                              : kind.data.branch.false_bb;
+            break;
+          case KOOPA_RVT_JUMP:
+            next = kind.data.jump.target;
+            break;
+          case KOOPA_RVT_RETURN:
+            result = kind.data.ret.value ? get(kind.data.ret.value) : 0;
+            return true;
+          default:
+            return false;
+        }
+      }
+      if (!next) {
+        return false;
+      }
+      bb = next;
+    }
+  }
+
+  bool Library(koopa_raw_function_t func, const std::vector<int32_t> &args, int32_t &result) {
+    static const char *const outputs[] = {"@putint", "@putch", "@starttime", "@stoptime"};
+    if (!allow_output_ || outputs_.size() == kMaxEvalOutputs ||
+        std::find(std::begin(outputs), std::end(outputs), std::string(func->name)) ==
+            std::end(outputs)) {
+      return false;
+    }
+    outputs_.push_back(Output{func, args});
+    result = 0;
+    return true;
+  }
+
+  int32_t &Global(koopa_raw_value_t var) {
+    auto it = globals_.find(var);
+    if (it == globals_.end()) {
+      it = globals_.emplace(var, InitialValue(var)).first;
+    }
+    return it->second;
+  }
+
+  size_t steps_;
+  bool allow_output_;
+  std::unordered_map<koopa_raw_value_t, int32_t> globals_;
+  std::vector<Output> outputs_;
+};
+
+// 参数都是常量, 不读写全局变量也没有 I/O 的调用在编译期算出结果. 算不出来的调用记下来,
+// 同样的调用不再重试
+class CallFolder {
+ public:
+  explicit CallFolder(const ModRefAnalysis &modref) : modref_(modref) {}
+
+  bool Fold(IRArena &arena, koopa_raw_function_t func) {
+    std::unordered_map<koopa_raw_value_t, koopa_raw_value_t> replaced;
+    for (size_t b = 0; b < func->bbs.len; b++) {
+      for (auto inst : Insts(SliceAt<koopa_raw_basic_block_t>(func->bbs, b))) {
+        if (inst->kind.tag != KOOPA_RVT_CALL || inst->ty->tag == KOOPA_RTT_UNIT) {
+          continue;
+        }
+        const auto &call = inst->kind.data.call;
+        const FunctionEffects &effects = modref_.Get(inst);
+        if (call.callee->bbs.len == 0 || !effects.Pure() || !effects.reads.empty()) {
+          continue;
+        }
+        std::vector<int32_t> args;
+        for (size_t i = 0; i < call.args.len; i++) {
+          auto arg = SliceAt<koopa_raw_value_t>(call.args, i);
+          if (!IsInteger(arg)) {
+            break;
+          }
+          args.push_back(arg->kind.data.integer.value);
+        }
+        if (args.size() != call.args.len) {
+          continue;
+        }
+        auto key = std::make_pair(call.callee, args);
+        auto it = results_.find(key);
+        if (it == results_.end()) {
+          Interpreter interpreter(kMaxCallEvalSteps, false);
+          int32_t result = 0;
+          bool ok = interpreter.Call(call.callee, args, result);
+          it = results_.emplace(key, std::make_pair(ok, result)).first;
+        }
+        if (it->second.first) {
+          replaced[inst] = arena.Integer(it->second.second);
+        }
+      }
+    }
+    if (replaced.empty()) {
+      return false;
+    }
+    ReplaceUses(func, replaced);
+    // 算出了结果说明调用一定会返回, 调用本身也可以删掉
+    for (size_t b = 0; b < func->bbs.len; b++) {
+      auto bb = SliceAt<koopa_raw_basic_block_t>(func->bbs, b);
+      std::vector<koopa_raw_value_t> kept;
+      for (auto inst : Insts(bb)) {
+        if (!replaced.count(inst)) {
+          kept.push_back(inst);
+        }
+      }
+      if (kept.size() != bb->insts.len) {
+        SetInsts(arena, bb, kept);
+      }
+    }
+    return true;
+  }
+
+ private:
+  const ModRefAnalysis &modref_;
+  // (函数, 参数) -> (是否算出来了, 结果)
+  std::map<std::pair<koopa_raw_function_t, std::vector<int32_t>>, std::pair<bool, int32_t>>
+      results_;
+};
+
+// 不读输入的程序在编译期执行 main, 成功时 main 改成依次调用执行中的输出函数, 再返回算出的值
+static bool EvaluateProgram(IRArena &arena, const koopa_raw_program_t &program) {
+  koopa_raw_function_t main = nullptr;
+  for (size_t f = 0; f < program.funcs.len; f++) {
+    auto func = SliceAt<koopa_raw_function_t>(program.funcs, f);
+    if (std::string(func->name) == "@main" && func->bbs.len != 0) {
+      main = func;
+    }
+  }
+  if (!main) {
+    return false;
+  }
+  Interpreter interpreter(kMaxProgramEvalSteps, true);
+  int32_t result = 0;
+  if (!interpreter.Call(main, {}, result)) {
+    return false;
+  }
+  std::vector<koopa_raw_value_t> insts;
+  for (const auto &output : interpreter.Outputs()) {
+    std::vector<const void *> args;
+    for (int32_t arg : output.args) {
+      args.push_back(arena.Integer(arg));
+    }
+    insts.push_back(arena.Call(output.callee, args));
+  }
+  insts.push_back(arena.Return(arena.Integer(result)));
+  koopa_raw_basic_block_data_t *entry = arena.NewBlock();
+  SetInsts(arena, entry, insts);
+  const_cast<koopa_raw_function_data_t *>(main)->bbs =
+      arena.Slice({entry}, KOOPA_RSIK_BASIC_BLOCK);
+  return true;
+}
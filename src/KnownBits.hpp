@@ -0,0 +1,391 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "IR.hpp"
+
+// 已知位和取值范围分析. 每个值记录一定是 0 / 一定是 1 的位, 以及有符号的取值范围 [lo, hi],
+// 两者互相收紧. 局部变量不会被取地址, 一个 alloc 的值就是所有 store 进去的值的并 (流不敏感),
+// 比如 LogicalExpAST 的结果变量只会被存入 0 和 1, 从它 load 出的值就是布尔值.
+// 分析结果用来删掉多余的布尔值规范化 (ne x, 0 之类), 化简布尔值的 and/or,
+// 以及把已知非负的值除以 2 的幂改成移位
+
+struct KnownBits {
+  uint32_t zero = 0;
+  uint32_t one = 0;
+  int64_t lo = INT32_MIN;
+  int64_t hi = INT32_MAX;
+
+  static KnownBits Constant(int32_t n) {
+    KnownBits k;
+    k.lo = k.hi = n;
+    k.Normalize();
+    return k;
+  }
+
+  // 超出 32 位的范围在回绕之后什么都不知道
+  static KnownBits Range(int64_t lo, int64_t hi) {
+    KnownBits k;
+    if (lo >= INT32_MIN && hi <= INT32_MAX) {
+      k.lo = lo;
+      k.hi = hi;
+    }
+    k.Normalize();
+    return k;
+  }
+
+  bool IsConstant() const {
+    return lo == hi;
+  }
+
+  bool IsBoolean() const {
+    return lo >= 0 && hi <= 1;
+  }
+
+  // 可能是 1 的位
+  uint32_t MaybeOne() const {
+    return ~zero;
+  }
+
+  // 低位连续的已知 0 的个数
+  int TrailingZeros() const {
+    int n = 0;
+    while (n < 32 && (zero >> n & 1)) {
+      n++;
+    }
+    return n;
+  }
+
+  // 两个值中的任意一个
+  KnownBits Meet(const KnownBits &other) const {
+    KnownBits k;
+    k.zero = zero & other.zero;
+    k.one = one & other.one;
+    k.lo = std::min(lo, other.lo);
+    k.hi = std::max(hi, other.hi);
+    k.Normalize();
+    return k;
+  }
+
+  bool operator==(const KnownBits &other) const {
+    return zero == other.zero && one == other.one && lo == other.lo && hi == other.hi;
+  }
+
+  bool operator!=(const KnownBits &other) const {
+    return !(*this == other);
+  }
+
+  void Normalize() {
+    // 范围 => 位: 同号的范围内, 比最高的变化位更高的位都是确定的
+    if (lo >= 0) {
+      zero |= ~LowMask((uint32_t)hi);
+    } else if (hi < 0) {
+      one |= ~LowMask(~(uint32_t)(int32_t)lo);
+    }
+    // 位 => 范围: 符号位确定时, 其余位全取已知的 1 得到最小值, 全取可能的 1 得到最大值
+    if (zero >> 31) {
+      lo = std::max<int64_t>(lo, one);
+      hi = std::min<int64_t>(hi, MaybeOne());
+    } else if (one >> 31) {
+      lo = std::max<int64_t>(lo, (int32_t)one);
+      hi = std::min<int64_t>(hi, (int32_t)MaybeOne());
+    }
+    if (lo == hi) {
+      one = (uint32_t)(int32_t)lo;
+      zero = ~one;
+    }
+  }
+
+ private:
+  // 覆盖 x 最高的 1 以及更低的所有位
+  static uint32_t LowMask(uint32_t x) {
+    x |= x >> 1;
+    x |= x >> 2;
+    x |= x >> 4;
+    x |= x >> 8;
+    x |= x >> 16;
+    return x;
+  }
+};
+
+// 比较的结果, 确定时返回 0 或 1, 不确定时返回 -1
+static int CompareKnownBits(koopa_raw_binary_op_t op, const KnownBits &a, const KnownBits &b) {
+  bool differ = a.hi < b.lo || b.hi < a.lo || (a.one & b.zero) || (a.zero & b.one);
+  switch (op) {
+    case KOOPA_RBO_EQ:
+      return differ ? 0 : -1;
+    case KOOPA_RBO_NOT_EQ:
+      return differ ? 1 : -1;
+    case KOOPA_RBO_LT:
+      return a.hi < b.lo ? 1 : a.lo >= b.hi ? 0 : -1;
+    case KOOPA_RBO_GE:
+      return a.hi < b.lo ? 0 : a.lo >= b.hi ? 1 : -1;
+    case KOOPA_RBO_GT:
+      return a.lo > b.hi ? 1 : a.hi <= b.lo ? 0 : -1;
+    case KOOPA_RBO_LE:
+      return a.lo > b.hi ? 0 : a.hi <= b.lo ? 1 : -1;
+    default:
+      return -1;
+  }
+}
+
+static KnownBits BinaryKnownBits(koopa_raw_binary_op_t op, const KnownBits &a,
+                                 const KnownBits &b) {
+  if (a.IsConstant() && b.IsConstant()) {
+    int32_t result;
+    if (FoldBinary(op, a.lo, b.lo, result)) {
+      return KnownBits::Constant(result);
+    }
+    return KnownBits();
+  }
+  KnownBits k;
+  switch (op) {
+    case KOOPA_RBO_EQ:
+    case KOOPA_RBO_NOT_EQ:
+    case KOOPA_RBO_LT:
+    case KOOPA_RBO_GT:
+    case KOOPA_RBO_LE:
+    case KOOPA_RBO_GE: {
+      int result = CompareKnownBits(op, a, b);
+      return result >= 0 ? KnownBits::Constant(result) : KnownBits::Range(0, 1);
+    }
+    case KOOPA_RBO_ADD:
+    case KOOPA_RBO_SUB: {
+      k = op == KOOPA_RBO_ADD ? KnownBits::Range(a.lo + b.lo, a.hi + b.hi)
+                              : KnownBits::Range(a.lo - b.hi, a.hi - b.lo);
+      int tz = std::min(a.TrailingZeros(), b.TrailingZeros());
+      k.zero |= tz == 32 ? ~0u : (1u << tz) - 1;
+      break;
+    }
+    case KOOPA_RBO_MUL: {
+      int64_t p[] = {a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi};
+      k = KnownBits::Range(*std::min_element(p, p + 4), *std::max_element(p, p + 4));
+      int tz = std::min(32, a.TrailingZeros() + b.TrailingZeros());
+      k.zero |= tz == 32 ? ~0u : (1u << tz) - 1;
+      break;
+    }
+    case KOOPA_RBO_DIV:
+      // 除以正数时商随被除数单调不减
+      if (b.IsConstant() && b.lo > 0) {
+        k = KnownBits::Range(a.lo / b.lo, a.hi / b.lo);
+      }
+      break;
+    case KOOPA_RBO_MOD:
+      // 余数的符号和被除数相同, 绝对值小于除数的绝对值
+      if (b.IsConstant() && b.lo != 0) {
+        int64_t m = std::min<int64_t>(std::abs(b.lo) - 1, INT32_MAX);
+        if (a.lo >= 0) {
+          k = KnownBits::Range(0, std::min(m, a.hi));
+        } else if (a.hi <= 0) {
+          k = KnownBits::Range(std::max(-m, a.lo), 0);
+        } else {
+          k = KnownBits::Range(-m, m);
+        }
+      }
+      break;
+    case KOOPA_RBO_AND:
+      k.zero = a.zero | b.zero;
+      k.one = a.one & b.one;
+      break;
+    case KOOPA_RBO_OR:
+      k.zero = a.zero & b.zero;
+      k.one = a.one | b.one;
+      break;
+    case KOOPA_RBO_XOR:
+      k.zero = (a.zero & b.zero) | (a.one & b.one);
+      k.one = (a.zero & b.one) | (a.one & b.zero);
+      break;
+    case KOOPA_RBO_SHL:
+    case KOOPA_RBO_SHR:
+    case KOOPA_RBO_SAR: {
+      if (!b.IsConstant()) {
+        break;
+      }
+      int s = b.lo & 31;
+      if (op == KOOPA_RBO_SHL) {
+        k.zero = a.zero << s | ((1u << s) - 1);
+        k.one = a.one << s;
+      } else if (op == KOOPA_RBO_SHR) {
+        k.zero = a.zero >> s | ~(~0u >> s);
+        k.one = a.one >> s;
+      } else {
+        k.zero = (uint32_t)((int32_t)a.zero >> s);
+        k.one = (uint32_t)((int32_t)a.one >> s);
+        k.lo = a.lo >> s;
+        k.hi = a.hi >> s;
+      }
+      break;
+    }
+    default:
+      break;
+  }
+  k.Normalize();
+  return k;
+}
+
+class KnownBitsAnalysis {
+ public:
+  explicit KnownBitsAnalysis(koopa_raw_function_t func) {
+    // 按逆后序计算, 回边带来的新值通过 alloc 传回去, 重新计算直到所有 alloc 都不再变化.
+    // 第二轮以后范围还在扩大的 alloc 直接把范围放宽到 int 的边界, 保证很快收敛
+    std::vector<koopa_raw_basic_block_t> order = ReversePostOrder(func);
+    bool changed = true;
+    for (int round = 0; changed; round++) {
+      changed = false;
+      facts_.clear();
+      for (auto bb : order) {
+        for (auto inst : Insts(bb)) {
+          const auto &kind = inst->kind;
+          switch (kind.tag) {
+            case KOOPA_RVT_BINARY:
+              facts_[inst] = BinaryKnownBits(kind.data.binary.op, Get(kind.data.binary.lhs),
+                                             Get(kind.data.binary.rhs));
+              break;
+            case KOOPA_RVT_LOAD: {
+              auto it = stored_.find(kind.data.load.src);
+              if (it != stored_.end()) {
+                facts_[inst] = it->second;
+              }
+              break;
+            }
+            case KOOPA_RVT_STORE: {
+              auto dest = kind.data.store.dest;
+              if (dest->kind.tag != KOOPA_RVT_ALLOC) {
+                break;
+              }
+              KnownBits value = Get(kind.data.store.value);
+              auto it = stored_.find(dest);
+              if (it == stored_.end()) {
+                stored_[dest] = value;
+                changed = true;
+                break;
+              }
+              KnownBits meet = it->second.Meet(value);
+              if (round > 0) {
+                meet.lo = meet.lo < it->second.lo ? INT32_MIN : meet.lo;
+                meet.hi = meet.hi > it->second.hi ? INT32_MAX : meet.hi;
+                meet.Normalize();
+              }
+              if (meet != it->second) {
+                it->second = meet;
+                changed = true;
+              }
+              break;
+            }
+            default:
+              break;
+          }
+        }
+      }
+    }
+  }
+
+  KnownBits Get(koopa_raw_value_t value) const {
+    if (IsInteger(value)) {
+      return KnownBits::Constant(value->kind.data.integer.value);
+    }
+    auto it = facts_.find(value);
+    return it == facts_.end() ? KnownBits() : it->second;
+  }
+
+ private:
+  std::unordered_map<koopa_raw_value_t, KnownBits> facts_;
+  // 每个 alloc 被 store 过的所有值的并
+  std::unordered_map<koopa_raw_value_t, KnownBits> stored_;
+};
+
+static int Log2Exact(int32_t c) {
+  if (c <= 0 || (c & (c - 1))) {
+    return -1;
+  }
+  int k = 0;
+  while ((1 << k) != c) {
+    k++;
+  }
+  return k;
+}
+
+// 用已知位化简一条 binary. 返回替换它的值, 或者原地改写后返回它本身
+static koopa_raw_value_t SimplifyWithKnownBits(IRArena &arena, const KnownBitsAnalysis &known,
+                                               koopa_raw_value_t inst) {
+  auto &bin = Mut(inst)->kind.data.binary;
+  KnownBits result = known.Get(inst);
+  if (result.IsConstant()) {
+    return arena.Integer(result.lo);
+  }
+  KnownBits a = known.Get(bin.lhs), b = known.Get(bin.rhs);
+  switch (bin.op) {
+    case KOOPA_RBO_NOT_EQ:
+    case KOOPA_RBO_EQ:
+      // 布尔值 != 0 和 == 1 就是它本身, != 1 就是 == 0
+      if (a.IsBoolean() && b.IsConstant() && (b.lo == 0 || b.lo == 1)) {
+        if ((bin.op == KOOPA_RBO_NOT_EQ) == (b.lo == 0)) {
+          return bin.lhs;
+        }
+        bin.op = KOOPA_RBO_EQ;
+        bin.rhs = arena.Integer(0);
+      }
+      break;
+    case KOOPA_RBO_AND:
+      // 一边可能为 1 的位在另一边都是 1 时, 结果就是这一边
+      if ((a.MaybeOne() & ~b.one) == 0) {
+        return bin.lhs;
+      }
+      if ((b.MaybeOne() & ~a.one) == 0) {
+        return bin.rhs;
+      }
+      break;
+    case KOOPA_RBO_OR:
+    case KOOPA_RBO_XOR:
+      // 一边可能为 1 的位在另一边都是 1 (or) 或者这一边全是 0 时, 结果就是另一边
+      if (b.MaybeOne() == 0 || (bin.op == KOOPA_RBO_OR && (b.MaybeOne() & ~a.one) == 0)) {
+        return bin.lhs;
+      }
+      if (a.MaybeOne() == 0 || (bin.op == KOOPA_RBO_OR && (a.MaybeOne() & ~b.one) == 0)) {
+        return bin.rhs;
+      }
+      break;
+    case KOOPA_RBO_DIV:
+    case KOOPA_RBO_MOD: {
+      // 非负数的有符号除法不需要向 0 取整的修正, 除以 2^k 就是移位, 取余就是取低位
+      int k = b.IsConstant() ? Log2Exact(b.lo) : -1;
+      if (k > 0 && a.lo >= 0) {
+        if (bin.op == KOOPA_RBO_DIV) {
+          bin.op = KOOPA_RBO_SAR;
+          bin.rhs = arena.Integer(k);
+        } else {
+          bin.op = KOOPA_RBO_AND;
+          bin.rhs = arena.Integer((1 << k) - 1);
+        }
+      }
+      break;
+    }
+    default:
+      break;
+  }
+  return inst;
+}
+
+static bool SimplifyKnownBits(IRArena &arena, koopa_raw_function_t func) {
+  KnownBitsAnalysis known(func);
+  std::unordered_map<koopa_raw_value_t, koopa_raw_value_t> replaced;
+  for (size_t b = 0; b < func->bbs.len; b++) {
+    for (auto inst : Insts(SliceAt<koopa_raw_basic_block_t>(func->bbs, b))) {
+      koopa_raw_value_t result = inst;
+      if (inst->kind.tag == KOOPA_RVT_BINARY) {
+        result = SimplifyWithKnownBits(arena, known, inst);
+      } else if (inst->kind.tag == KOOPA_RVT_LOAD && known.Get(inst).IsConstant()) {
+        // 只被存入过同一个常量的变量
+        result = arena.Integer(known.Get(inst).lo);
+      }
+      if (result != inst) {
+        replaced[inst] = result;
+      }
+    }
+  }
+  ReplaceUses(func, replaced);
+  RemoveUnusedValues(arena, func);
+  return !replaced.empty();
+}
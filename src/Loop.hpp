@@ -0,0 +1,136 @@
+#pragma once
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "IR.hpp"
+
+// 自然循环. 前端生成的 CFG 都是可归约的, DFS 中指向栈上祖先的边就是回边, 回边的源能不经过
+// 循环头到达的块都属于这个循环, 同一个循环头的多条回边 (continue) 合并成一个循环
+
+struct Loop {
+  koopa_raw_basic_block_t header;
+  // 循环外唯一的前驱, 以 jump header 结尾, 提到循环外的指令放在这里
+  koopa_raw_basic_block_t preheader = nullptr;
+  std::unordered_set<koopa_raw_basic_block_t> blocks;
+  // 循环外的后继
+  std::vector<koopa_raw_basic_block_t> exits;
+
+  bool Contains(koopa_raw_basic_block_t bb) const {
+    return blocks.count(bb);
+  }
+};
+
+// 函数里所有的循环, 内层循环排在外层之前. 没有 preheader 的循环会新建一个
+static std::vector<Loop> FindLoops(IRArena &arena, koopa_raw_function_t func) {
+  std::unordered_map<koopa_raw_basic_block_t, std::vector<koopa_raw_basic_block_t>> preds;
+  for (size_t b = 0; b < func->bbs.len; b++) {
+    auto bb = SliceAt<koopa_raw_basic_block_t>(func->bbs, b);
+    for (auto succ : Successors(bb)) {
+      preds[succ].push_back(bb);
+    }
+  }
+  std::unordered_map<koopa_raw_basic_block_t, Loop> by_header;
+  std::vector<koopa_raw_basic_block_t> headers;
+  std::unordered_map<koopa_raw_basic_block_t, int> state;
+  std::vector<std::pair<koopa_raw_basic_block_t, size_t>> stack;
+  auto entry = SliceAt<koopa_raw_basic_block_t>(func->bbs, 0);
+  state[entry] = 1;
+  stack.push_back({entry, 0});
+  while (!stack.empty()) {
+    auto &[bb, k] = stack.back();
+    auto succs = Successors(bb);
+    if (k == succs.size()) {
+      state[bb] = 2;
+      stack.pop_back();
+      continue;
+    }
+    auto succ = succs[k++];
+    if (state[succ] == 0) {
+      state[succ] = 1;
+      stack.push_back({succ, 0});
+      continue;
+    }
+    if (state[succ] != 1) {
+      continue;
+    }
+    // bb -> succ 是回边
+    if (!by_header.count(succ)) {
+      by_header[succ].header = succ;
+      by_header[succ].blocks.insert(succ);
+      headers.push_back(succ);
+    }
+    Loop &loop = by_header[succ];
+    std::vector<koopa_raw_basic_block_t> work = {bb};
+    while (!work.empty()) {
+      auto x = work.back();
+      work.pop_back();
+      if (loop.blocks.insert(x).second) {
+        work.insert(work.end(), preds[x].begin(), preds[x].end());
+      }
+    }
+  }
+
+  std::vector<Loop> loops;
+  std::vector<koopa_raw_basic_block_t> new_blocks;
+  for (auto header : headers) {
+    Loop &loop = by_header[header];
+    std::vector<koopa_raw_basic_block_t> outside;
+    for (auto pred : preds[header]) {
+      if (!loop.Contains(pred)) {
+        outside.push_back(pred);
+      }
+    }
+    if (outside.empty()) {
+      // 循环头是入口, 没有地方放 preheader
+      continue;
+    }
+    if (outside.size() == 1 && Successors(outside[0]).size() == 1) {
+      loop.preheader = outside[0];
+    } else {
+      // 所有从循环外进入的边都改成先到新的 preheader
+      koopa_raw_basic_block_t preheader = arena.NewBlock();
+      SetInsts(arena, preheader, {arena.Jump(header)});
+      for (auto pred : outside) {
+        auto &kind = Mut(SliceAt<koopa_raw_value_t>(pred->insts, pred->insts.len - 1))->kind;
+        if (kind.tag == KOOPA_RVT_JUMP) {
+          kind.data.jump.target = preheader;
+        } else if (kind.tag == KOOPA_RVT_BRANCH) {
+          if (kind.data.branch.true_bb == header) {
+            kind.data.branch.true_bb = preheader;
+          }
+          if (kind.data.branch.false_bb == header) {
+            kind.data.branch.false_bb = preheader;
+          }
+        }
+      }
+      new_blocks.push_back(preheader);
+      loop.preheader = preheader;
+    }
+    loops.push_back(loop);
+  }
+  if (!new_blocks.empty()) {
+    AddBlocks(arena, func, new_blocks);
+  }
+  for (auto &loop : loops) {
+    // 新建的 preheader 属于外层循环
+    for (const auto &inner : loops) {
+      if (&inner != &loop && loop.Contains(inner.header)) {
+        loop.blocks.insert(inner.preheader);
+      }
+    }
+    for (auto bb : loop.blocks) {
+      for (auto succ : Successors(bb)) {
+        if (!loop.Contains(succ) &&
+            std::find(loop.exits.begin(), loop.exits.end(), succ) == loop.exits.end()) {
+          loop.exits.push_back(succ);
+        }
+      }
+    }
+  }
+  std::stable_sort(loops.begin(), loops.end(), [](const Loop &a, const Loop &b) {
+    return a.blocks.size() < b.blocks.size();
+  });
+  return loops;
+}
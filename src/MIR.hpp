@@ -0,0 +1,435 @@
+#pragma once
+
+#include <algorithm>
+#include <bitset>
+#include <cassert>
+#include <deque>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// 机器指令层: 后端先把 Koopa raw 翻译成 MachineInstr, 寄存器分配和其他优化都在这一层完成,
+// 最后才打印成汇编文本
+
+// 物理寄存器的编号就是 reg_names 的下标, 编号不小于 kFirstVReg 的是虚拟寄存器
+static std::string reg_names[] = {"x0", "t0", "t1", "t2", "t3", "t4", "t5", "t6",
+                                  "a0", "a1", "a2", "a3", "a4", "a5", "a6", "a7",
+                                  "sp", "ra", "s0", "s1", "s2", "s3", "s4", "s5",
+                                  "s6", "s7", "s8", "s9", "s10", "s11"};
+static const int kSp = 16;
+static const int kRa = 17;
+static const int kS0 = 18;
+static const int kFirstVReg = 32;
+
+static bool IsVReg(int reg) {
+  return reg >= kFirstVReg;
+}
+
+// 分配完寄存器之后的活跃性只需要考虑物理寄存器
+using RegSet = std::bitset<kFirstVReg>;
+
+enum class MOp {
+  // rd, imm
+  kLi,
+  kLui,
+  // rd, sym
+  kLa,
+  // rd, rs1
+  kMv,
+  kSeqz,
+  kSnez,
+  // rd, rs1, rs2
+  kAdd,
+  kSub,
+  kMul,
+  kMulh,
+  kDiv,
+  kRem,
+  kAnd,
+  kOr,
+  kXor,
+  kSll,
+  kSrl,
+  kSra,
+  kSlt,
+  kSgt,
+  // rd, rs1, imm
+  kAddi,
+  kAndi,
+  kOri,
+  kXori,
+  kSlti,
+  kSlli,
+  kSrli,
+  kSrai,
+  // lw rd, imm(rs1) 或者读全局变量 sym (lui rd, %hi(sym); lw rd, %lo(sym)(rd))
+  kLw,
+  // sw rs2, imm(rs1) 或者写全局变量 sym, rd 是保存地址高位的临时寄存器
+  kSw,
+  // rs1, sym
+  kBeqz,
+  kBnez,
+  // rs1, rs2, sym
+  kBeq,
+  kBne,
+  kBlt,
+  kBge,
+  kBltu,
+  kBgeu,
+  // sym
+  kJ,
+  // rs1, sym 是跳转表的名字
+  kJr,
+  // sym, imm 是传参寄存器的个数
+  kCall,
+  kRet,
+};
+
+static const char *mop_names[] = {
+    "li",   "lui",  "la",   "mv",   "seqz", "snez", "add",  "sub",  "mul", "mulh",
+    "div",  "rem",  "and",  "or",   "xor",  "sll",  "srl",  "sra",  "slt", "sgt",
+    "addi", "andi", "ori",  "xori", "slti", "slli", "srli", "srai", "lw",  "sw",
+    "beqz", "bnez", "beq",  "bne",  "blt",  "bge",  "bltu", "bgeu", "j",   "jr",
+    "call", "ret"};
+
+struct MachineInstr {
+  MOp op;
+  int rd = -1;
+  int rs1 = -1;
+  int rs2 = -1;
+  int imm = 0;
+  // 跳转目标, 被调用的函数, 或者读写的全局变量
+  std::string sym;
+
+  bool IsBranch() const {
+    return op >= MOp::kBeqz && op <= MOp::kBgeu;
+  }
+
+  bool IsTerminator() const {
+    return IsBranch() || op == MOp::kJ || op == MOp::kJr || op == MOp::kRet;
+  }
+
+  // 写全局变量时, 地址寄存器在读 rs2 之前就被写入了, 不能和 rs2 分到同一个寄存器
+  bool EarlyClobber() const {
+    return op == MOp::kSw && !sym.empty();
+  }
+
+  std::vector<int> Defs() const {
+    switch (op) {
+      case MOp::kSw:
+        return sym.empty() ? std::vector<int>{} : std::vector<int>{rd};
+      case MOp::kCall: {
+        // caller-saved 寄存器都会被破坏
+        std::vector<int> defs = {kRa};
+        for (int i = 1; i < 16; i++) {
+          defs.push_back(i);
+        }
+        return defs;
+      }
+      case MOp::kBeqz:
+      case MOp::kBnez:
+      case MOp::kBeq:
+      case MOp::kBne:
+      case MOp::kBlt:
+      case MOp::kBge:
+      case MOp::kBltu:
+      case MOp::kBgeu:
+      case MOp::kJ:
+      case MOp::kJr:
+      case MOp::kRet:
+        return {};
+      default:
+        return {rd};
+    }
+  }
+
+  std::vector<int> Uses() const {
+    switch (op) {
+      case MOp::kLi:
+      case MOp::kLui:
+      case MOp::kLa:
+      case MOp::kJ:
+        return {};
+      case MOp::kLw:
+        return sym.empty() ? std::vector<int>{rs1} : std::vector<int>{};
+      case MOp::kSw:
+        return sym.empty() ? std::vector<int>{rs2, rs1} : std::vector<int>{rs2};
+      case MOp::kCall: {
+        std::vector<int> uses;
+        for (int i = 0; i < std::min(imm, 8); i++) {
+          uses.push_back(8 + i);
+        }
+        uses.push_back(kSp);
+        return uses;
+      }
+      case MOp::kRet:
+        return {8, kRa, kSp};
+      default:
+        break;
+    }
+    std::vector<int> uses;
+    if (rs1 >= 0) {
+      uses.push_back(rs1);
+    }
+    if (rs2 >= 0) {
+      uses.push_back(rs2);
+    }
+    return uses;
+  }
+};
+
+struct MachineBasicBlock {
+  std::string label;
+  std::vector<MachineInstr> insts;
+};
+
+// .rodata 里的跳转表, 每一项是一个块的地址
+struct JumpTable {
+  std::string name;
+  std::vector<std::string> targets;
+};
+
+struct MachineFunction {
+  std::string name;
+  std::vector<MachineBasicBlock> blocks;
+  std::vector<JumpTable> jump_tables;
+  // 入口处先把 gp 指向 __global_pointer$ (只有 main 需要), gp 不参与寄存器分配
+  bool setup_gp = false;
+  int next_vreg = kFirstVReg;
+
+  int NewVReg() {
+    return next_vreg++;
+  }
+};
+
+// 虚拟寄存器只在生成单条 Koopa 指令的过程中存活, 不会跨基本块, 按块内的使用顺序
+// 从 pool 里分配物理寄存器, 最后一次使用之后立刻释放
+static void AllocateVRegs(MachineFunction &mf, const std::vector<int> &pool) {
+  for (auto &mbb : mf.blocks) {
+    std::unordered_map<int, size_t> last_use;
+    for (size_t i = 0; i < mbb.insts.size(); i++) {
+      for (int reg : mbb.insts[i].Uses()) {
+        if (IsVReg(reg)) {
+          last_use[reg] = i;
+        }
+      }
+    }
+    std::unordered_map<int, int> assigned;
+    // 先释放的寄存器先复用, 相邻的临时值尽量落在不同的寄存器上, 给指令调度留出余地
+    std::deque<int> free_regs(pool.begin(), pool.end());
+    auto release_uses = [&](const MachineInstr &inst, size_t i) {
+      for (int reg : inst.Uses()) {
+        auto it = assigned.find(reg);
+        if (it != assigned.end() && last_use[reg] == i) {
+          free_regs.push_back(it->second);
+          assigned.erase(it);
+        }
+      }
+    };
+    for (size_t i = 0; i < mbb.insts.size(); i++) {
+      MachineInstr &inst = mbb.insts[i];
+      MachineInstr orig = inst;
+      for (int *reg : {&inst.rs1, &inst.rs2}) {
+        if (IsVReg(*reg)) {
+          assert(assigned.count(*reg));
+          *reg = assigned[*reg];
+        }
+      }
+      if (!orig.EarlyClobber()) {
+        release_uses(orig, i);
+      }
+      if (IsVReg(inst.rd) && assigned.count(inst.rd)) {
+        // 重新定义一个还活着的虚拟寄存器 (比如 add v, v, sp), 继续用原来的寄存器
+        inst.rd = assigned[inst.rd];
+      } else if (IsVReg(inst.rd)) {
+        assert(!free_regs.empty());
+        int reg = free_regs.front();
+        free_regs.pop_front();
+        if (last_use.count(inst.rd) && last_use[inst.rd] > i) {
+          assigned[inst.rd] = reg;
+        } else {
+          free_regs.push_back(reg);
+        }
+        inst.rd = reg;
+      }
+      if (orig.EarlyClobber()) {
+        release_uses(orig, i);
+      }
+    }
+  }
+}
+
+// 每个块的后继 (下标), 块末尾不是 j/jr/ret 时会 fallthrough 到下一个块
+static std::vector<std::vector<size_t>> Successors(const MachineFunction &mf) {
+  std::unordered_map<std::string, size_t> index;
+  for (size_t b = 0; b < mf.blocks.size(); b++) {
+    index[mf.blocks[b].label] = b;
+  }
+  std::unordered_map<std::string, const JumpTable *> tables;
+  for (const auto &table : mf.jump_tables) {
+    tables[table.name] = &table;
+  }
+  std::vector<std::vector<size_t>> succs(mf.blocks.size());
+  for (size_t b = 0; b < mf.blocks.size(); b++) {
+    const auto &insts = mf.blocks[b].insts;
+    bool fallthrough = true;
+    for (const auto &inst : insts) {
+      if (inst.IsBranch() || inst.op == MOp::kJ) {
+        succs[b].push_back(index.at(inst.sym));
+      } else if (inst.op == MOp::kJr) {
+        for (const auto &target : tables.at(inst.sym)->targets) {
+          succs[b].push_back(index.at(target));
+        }
+      }
+    }
+    if (!insts.empty() && (insts.back().op == MOp::kJ || insts.back().op == MOp::kJr ||
+                           insts.back().op == MOp::kRet)) {
+      fallthrough = false;
+    }
+    if (fallthrough && b + 1 < mf.blocks.size()) {
+      succs[b].push_back(b + 1);
+    }
+  }
+  return succs;
+}
+
+// 把一条指令的效果倒着作用到活跃集合上
+static void StepBackward(RegSet &live, const MachineInstr &inst) {
+  for (int reg : inst.Defs()) {
+    live.reset(reg);
+  }
+  for (int reg : inst.Uses()) {
+    live.set(reg);
+  }
+  live.reset(0);
+}
+
+// 每个块出口处活跃的物理寄存器
+static std::vector<RegSet> ComputeLiveOut(const MachineFunction &mf) {
+  auto succs = Successors(mf);
+  std::vector<RegSet> live_in(mf.blocks.size()), live_out(mf.blocks.size());
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t b = mf.blocks.size(); b-- > 0;) {
+      RegSet out;
+      for (size_t s : succs[b]) {
+        out |= live_in[s];
+      }
+      RegSet in = out;
+      const auto &insts = mf.blocks[b].insts;
+      for (size_t i = insts.size(); i-- > 0;) {
+        StepBackward(in, insts[i]);
+      }
+      if (out != live_out[b] || in != live_in[b]) {
+        live_out[b] = out;
+        live_in[b] = in;
+        changed = true;
+      }
+    }
+  }
+  return live_out;
+}
+
+static std::ostream &PrintReg(std::ostream &os, int reg) {
+  if (IsVReg(reg)) {
+    return os << "%v" << reg - kFirstVReg;
+  }
+  return os << reg_names[reg];
+}
+
+static void Print(std::ostream &os, const MachineInstr &inst) {
+  // 读写全局变量用 lui + %lo 的绝对地址. 链接时加上 --relax-gp, 离 gp 不远的变量 (.sdata/.sbss)
+  // 会被松弛成一条相对 gp 的 lw/sw, 链接器只松弛这种形式, 不松弛 auipc 的 lw rd, sym
+  if ((inst.op == MOp::kLw || inst.op == MOp::kSw) && !inst.sym.empty()) {
+    PrintReg(os << "\tlui ", inst.rd) << ", %hi(" << inst.sym << ")\n";
+    PrintReg(os << "\t" << mop_names[static_cast<int>(inst.op)] << " ",
+             inst.op == MOp::kLw ? inst.rd : inst.rs2);
+    PrintReg(os << ", %lo(" << inst.sym << ")(", inst.rd) << ")\n";
+    return;
+  }
+  os << "\t" << mop_names[static_cast<int>(inst.op)];
+  switch (inst.op) {
+    case MOp::kLi:
+    case MOp::kLui:
+      PrintReg(os << " ", inst.rd) << ", " << inst.imm;
+      break;
+    case MOp::kLa:
+      PrintReg(os << " ", inst.rd) << ", " << inst.sym;
+      break;
+    case MOp::kMv:
+    case MOp::kSeqz:
+    case MOp::kSnez:
+      PrintReg(PrintReg(os << " ", inst.rd) << ", ", inst.rs1);
+      break;
+    case MOp::kAddi:
+    case MOp::kAndi:
+    case MOp::kOri:
+    case MOp::kXori:
+    case MOp::kSlti:
+    case MOp::kSlli:
+    case MOp::kSrli:
+    case MOp::kSrai:
+      PrintReg(PrintReg(os << " ", inst.rd) << ", ", inst.rs1) << ", " << inst.imm;
+      break;
+    case MOp::kLw:
+      PrintReg(PrintReg(os << " ", inst.rd) << ", " << inst.imm << "(", inst.rs1) << ")";
+      break;
+    case MOp::kSw:
+      PrintReg(PrintReg(os << " ", inst.rs2) << ", " << inst.imm << "(", inst.rs1) << ")";
+      break;
+    case MOp::kBeqz:
+    case MOp::kBnez:
+      PrintReg(os << " ", inst.rs1) << ", " << inst.sym;
+      break;
+    case MOp::kBeq:
+    case MOp::kBne:
+    case MOp::kBlt:
+    case MOp::kBge:
+    case MOp::kBltu:
+    case MOp::kBgeu:
+      PrintReg(PrintReg(os << " ", inst.rs1) << ", ", inst.rs2) << ", " << inst.sym;
+      break;
+    case MOp::kJ:
+    case MOp::kCall:
+      os << " " << inst.sym;
+      break;
+    case MOp::kJr:
+      PrintReg(os << " ", inst.rs1);
+      break;
+    case MOp::kRet:
+      break;
+    default:
+      PrintReg(PrintReg(PrintReg(os << " ", inst.rd) << ", ", inst.rs1) << ", ", inst.rs2);
+      break;
+  }
+  os << "\n";
+}
+
+static void Print(std::ostream &os, const MachineFunction &mf) {
+  os << "\t.text\n";
+  os << "\t.global " << mf.name << "\n";
+  for (const auto &mbb : mf.blocks) {
+    os << mbb.label << ":\n";
+    // la 本身不能被松弛成相对 gp 的地址计算, 那时 gp 还没有值
+    if (mf.setup_gp && &mbb == &mf.blocks.front()) {
+      os << "\t.option push\n";
+      os << "\t.option norelax\n";
+      os << "\tla gp, __global_pointer$\n";
+      os << "\t.option pop\n";
+    }
+    for (const auto &inst : mbb.insts) {
+      Print(os, inst);
+    }
+  }
+  for (const auto &table : mf.jump_tables) {
+    os << "\t.section .rodata\n";
+    os << "\t.align 2\n";
+    os << table.name << ":\n";
+    for (const auto &target : table.targets) {
+      os << "\t.word " << target << "\n";
+    }
+  }
+  os << "\n";
+}
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "IR.hpp"
+#include "Loop.hpp"
+
+// 过程间的副作用分析: 在调用图上求不动点, 得到每个函数 (连同它调用的函数) 可能读写的
+// 全局变量, 以及是否做 I/O. 库函数 (只有声明的函数) 只做 I/O, 不碰程序里的全局变量.
+// 局部变量不会被取地址, call 只会影响全局变量
+
+struct FunctionEffects {
+  std::unordered_set<koopa_raw_value_t> reads;
+  std::unordered_set<koopa_raw_value_t> writes;
+  bool io = false;
+  // 可能不返回或者出错: 有循环, 递归, 或者除以不是常量的数
+  bool may_fail = false;
+
+  // 没有可见的副作用, 参数和读到的全局变量相同时结果也相同
+  bool Pure() const {
+    return !io && writes.empty();
+  }
+
+  // 提前执行也没有问题
+  bool Speculatable() const {
+    return Pure() && !may_fail;
+  }
+};
+
+class ModRefAnalysis {
+ public:
+  explicit ModRefAnalysis(const koopa_raw_program_t &program) {
+    std::unordered_map<koopa_raw_function_t, std::vector<koopa_raw_function_t>> callees;
+    std::vector<koopa_raw_function_t> funcs;
+    for (size_t f = 0; f < program.funcs.len; f++) {
+      auto func = SliceAt<koopa_raw_function_t>(program.funcs, f);
+      funcs.push_back(func);
+      FunctionEffects &effects = effects_[func];
+      if (func->bbs.len == 0) {
+        effects.io = true;
+        continue;
+      }
+      auto order = ReversePostOrder(func);
+      std::unordered_map<koopa_raw_basic_block_t, size_t> index;
+      for (size_t b = 0; b < order.size(); b++) {
+        index[order[b]] = b;
+      }
+      for (size_t b = 0; b < order.size(); b++) {
+        for (auto succ : Successors(order[b])) {
+          // 逆后序里往回走的边就是回边
+          if (index[succ] <= b) {
+            effects.may_fail = true;
+          }
+        }
+        for (auto inst : Insts(order[b])) {
+          const auto &kind = inst->kind;
+          if (kind.tag == KOOPA_RVT_LOAD && IsGlobal(kind.data.load.src)) {
+            effects.reads.insert(kind.data.load.src);
+          } else if (kind.tag == KOOPA_RVT_STORE && IsGlobal(kind.data.store.dest)) {
+            effects.writes.insert(kind.data.store.dest);
+          } else if (kind.tag == KOOPA_RVT_CALL) {
+            callees[func].push_back(kind.data.call.callee);
+          } else if (kind.tag == KOOPA_RVT_BINARY) {
+            auto op = kind.data.binary.op;
+            auto rhs = kind.data.binary.rhs;
+            if ((op == KOOPA_RBO_DIV || op == KOOPA_RBO_MOD) &&
+                (!IsInteger(rhs) || IsInteger(rhs, 0))) {
+              effects.may_fail = true;
+            }
+          }
+        }
+      }
+    }
+    // 递归的函数不一定会返回
+    for (auto func : funcs) {
+      std::unordered_set<koopa_raw_function_t> reached;
+      std::vector<koopa_raw_function_t> work = callees[func];
+      while (!work.empty()) {
+        auto callee = work.back();
+        work.pop_back();
+        if (reached.insert(callee).second) {
+          work.insert(work.end(), callees[callee].begin(), callees[callee].end());
+        }
+      }
+      if (reached.count(func)) {
+        effects_[func].may_fail = true;
+      }
+    }
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (auto func : funcs) {
+        FunctionEffects &effects = effects_[func];
+        for (auto callee : callees[func]) {
+          const FunctionEffects &other = effects_[callee];
+          size_t before = effects.reads.size() + effects.writes.size();
+          bool io = effects.io, may_fail = effects.may_fail;
+          effects.reads.insert(other.reads.begin(), other.reads.end());
+          effects.writes.insert(other.writes.begin(), other.writes.end());
+          effects.io |= other.io;
+          effects.may_fail |= other.may_fail;
+          changed |= effects.reads.size() + effects.writes.size() != before ||
+                     effects.io != io || effects.may_fail != may_fail;
+        }
+      }
+    }
+  }
+
+  const FunctionEffects &Get(koopa_raw_function_t func) const {
+    return effects_.at(func);
+  }
+
+  const FunctionEffects &Get(koopa_raw_value_t call) const {
+    return Get(call->kind.data.call.callee);
+  }
+
+  static bool IsGlobal(koopa_raw_value_t value) {
+    return value->kind.tag == KOOPA_RVT_GLOBAL_ALLOC;
+  }
+
+  // call 可能改变变量 var 的值吗
+  bool MayWrite(koopa_raw_value_t call, koopa_raw_value_t var) const {
+    return IsGlobal(var) && Get(call).writes.count(var);
+  }
+
+ private:
+  std::unordered_map<koopa_raw_function_t, FunctionEffects> effects_;
+};
+
+// 对同一个函数的两次调用参数都相同
+static bool SameCall(koopa_raw_value_t a, koopa_raw_value_t b) {
+  const auto &x = a->kind.data.call, &y = b->kind.data.call;
+  if (x.callee != y.callee || x.args.len != y.args.len) {
+    return false;
+  }
+  for (size_t i = 0; i < x.args.len; i++) {
+    auto u = SliceAt<koopa_raw_value_t>(x.args, i), v = SliceAt<koopa_raw_value_t>(y.args, i);
+    if (u != v && !(IsInteger(u) && IsInteger(v, u->kind.data.integer.value))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// 循环里可以提前执行, 参数和读到的全局变量都不随循环变化的调用提到 preheader.
+// 参数是从循环里没有被写的变量 load 出来的, 在 preheader 里重新 load
+static bool HoistLoopCalls(IRArena &arena, const Loop &loop, const ModRefAnalysis &modref) {
+  std::unordered_set<koopa_raw_value_t> defined, written;
+  std::vector<koopa_raw_value_t> calls;
+  for (auto bb : loop.blocks) {
+    for (auto inst : Insts(bb)) {
+      defined.insert(inst);
+      const auto &kind = inst->kind;
+      if (kind.tag == KOOPA_RVT_STORE) {
+        written.insert(kind.data.store.dest);
+      } else if (kind.tag == KOOPA_RVT_CALL) {
+        const FunctionEffects &effects = modref.Get(inst);
+        written.insert(effects.writes.begin(), effects.writes.end());
+        calls.push_back(inst);
+      }
+    }
+  }
+  std::vector<koopa_raw_value_t> hoisted;
+  for (auto call : calls) {
+    const FunctionEffects &effects = modref.Get(call);
+    if (!effects.Speculatable() || call->ty->tag == KOOPA_RTT_UNIT ||
+        std::any_of(effects.reads.begin(), effects.reads.end(),
+                    [&](koopa_raw_value_t var) { return written.count(var); })) {
+      continue;
+    }
+    bool invariant = true;
+    for (auto slot : OperandSlots(call)) {
+      auto arg = *slot;
+      bool reload = arg->kind.tag == KOOPA_RVT_LOAD && !written.count(arg->kind.data.load.src) &&
+                    !defined.count(arg->kind.data.load.src);
+      if (defined.count(arg) && !reload) {
+        invariant = false;
+      }
+    }
+    if (invariant) {
+      hoisted.push_back(call);
+    }
+  }
+  if (hoisted.empty()) {
+    return false;
+  }
+  for (auto bb : loop.blocks) {
+    std::vector<koopa_raw_value_t> insts = Insts(bb);
+    auto end = std::remove_if(insts.begin(), insts.end(), [&](koopa_raw_value_t inst) {
+      return std::find(hoisted.begin(), hoisted.end(), inst) != hoisted.end();
+    });
+    if (end != insts.end()) {
+      insts.erase(end, insts.end());
+      SetInsts(arena, bb, insts);
+    }
+  }
+  std::vector<koopa_raw_value_t> insts = Insts(loop.preheader);
+  auto term = insts.back();
+  insts.pop_back();
+  for (auto call : hoisted) {
+    for (auto slot : OperandSlots(call)) {
+      if (defined.count(*slot)) {
+        *slot = arena.Load((*slot)->kind.data.load.src);
+        insts.push_back(*slot);
+      }
+    }
+    insts.push_back(call);
+  }
+  insts.push_back(term);
+  SetInsts(arena, loop.preheader, insts);
+  return true;
+}
+
+static bool HoistPureCalls(IRArena &arena, koopa_raw_function_t func,
+                           const ModRefAnalysis &modref) {
+  bool changed = false;
+  bool hoisted = true;
+  // 提到内层 preheader 的调用可能还能继续提到外层
+  while (hoisted) {
+    hoisted = false;
+    for (const Loop &loop : FindLoops(arena, func)) {
+      if (loop.preheader && HoistLoopCalls(arena, loop, modref)) {
+        hoisted = true;
+        break;
+      }
+    }
+    changed |= hoisted;
+  }
+  return changed;
+}
@@ -0,0 +1,463 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "IR.hpp"
+#include "ModRef.hpp"
+
+// 部分冗余消除 (lazy code motion, Knoop/Rüthing/Steffen). 表达式按字面比较: 同样的运算,
+// 操作数是同样的变量 (块内 load 之后没有被改写), 同样的常量或者同样的子表达式. 只在部分路径上
+// 已经算过的表达式, 在其余路径的边上补算一次, 结果存进一个新的局部变量, 原来的重复计算改成
+// load 它. 插入点尽量晚, 临时变量活得尽量短. 需要在关键边上插入时拆出一个新块.
+// 同一块里操作数没有被改写过的重复计算直接用前一次的结果
+
+enum class PreOperandKind { kVar, kConst, kExpr };
+// 表达式的操作数: (类别, 变量, 常量或者子表达式的编号)
+using PreOperand = std::tuple<PreOperandKind, koopa_raw_value_t, int32_t>;
+using PreExpr = std::tuple<koopa_raw_binary_op_t, PreOperand, PreOperand>;
+
+// 值得移动的表达式. 临时变量在有调用的函数里放在栈上, 多一次 load/store, 这时只有除法和取模
+// (除以常数也要展开成好几条指令) 比重新算便宜; 叶子函数里临时变量在寄存器里, 乘法也值得.
+// 其他运算只作为子表达式一起移动, 比较还要留在原地和 br 融合
+static bool IsPreCandidate(koopa_raw_binary_op_t op, bool leaf) {
+  return op == KOOPA_RBO_DIV || op == KOOPA_RBO_MOD || (leaf && op == KOOPA_RBO_MUL);
+}
+
+class PartialRedundancy {
+ public:
+  PartialRedundancy(koopa_raw_function_t func, const ModRefAnalysis &modref)
+      : func_(func), modref_(modref) {}
+
+  bool Run(IRArena &arena) {
+    CollectBlocks();
+    if (PredecessorCounts(func_).at(blocks_[0]) != 0) {
+      // 入口也是循环头时没有地方放只执行一次的代码
+      return false;
+    }
+    CollectExpressions();
+    if (exprs_.empty()) {
+      return false;
+    }
+    ComputeLocal();
+    ComputeGlobal();
+    return Transform(arena);
+  }
+
+ private:
+  using Bits = std::vector<bool>;
+
+  void CollectBlocks() {
+    for (size_t b = 0; b < func_->bbs.len; b++) {
+      auto bb = SliceAt<koopa_raw_basic_block_t>(func_->bbs, b);
+      index_[bb] = blocks_.size();
+      blocks_.push_back(bb);
+    }
+    preds_.resize(blocks_.size());
+    succs_.resize(blocks_.size());
+    for (size_t b = 0; b < blocks_.size(); b++) {
+      for (auto succ : Successors(blocks_[b])) {
+        succs_[b].push_back(index_[succ]);
+        preds_[index_[succ]].push_back(b);
+      }
+    }
+  }
+
+  // inst 之后会被改写的变量
+  std::vector<koopa_raw_value_t> Kills(koopa_raw_value_t inst) const {
+    if (inst->kind.tag == KOOPA_RVT_STORE) {
+      return {inst->kind.data.store.dest};
+    }
+    if (inst->kind.tag == KOOPA_RVT_CALL) {
+      const auto &writes = modref_.Get(inst).writes;
+      return std::vector<koopa_raw_value_t>(writes.begin(), writes.end());
+    }
+    return {};
+  }
+
+  // 做 I/O 或者可能不返回的调用. 可能出错的表达式不能越过它提前算, 否则除以 0 会出现在调用的
+  // 输出之前, 或者在调用根本不返回时出现
+  bool IsBarrier(koopa_raw_value_t inst) const {
+    if (inst->kind.tag != KOOPA_RVT_CALL) {
+      return false;
+    }
+    const auto &effects = modref_.Get(inst);
+    return effects.io || effects.may_fail;
+  }
+
+  // 每个块里的表达式计算和对变量的改写, 按出现的顺序
+  void CollectExpressions() {
+    bool leaf = true;
+    for (auto bb : blocks_) {
+      for (auto inst : Insts(bb)) {
+        leaf = leaf && inst->kind.tag != KOOPA_RVT_CALL;
+      }
+    }
+    std::map<PreExpr, size_t> ids;
+    events_.resize(blocks_.size());
+    for (size_t b = 0; b < blocks_.size(); b++) {
+      // 块内还能代表变量当前值的 load, 和操作数都没被改写过的表达式
+      std::unordered_map<koopa_raw_value_t, koopa_raw_value_t> loaded;
+      std::unordered_map<koopa_raw_value_t, size_t> known;
+      auto operand = [&](koopa_raw_value_t value, PreOperand &op) {
+        if (IsInteger(value)) {
+          op = {PreOperandKind::kConst, nullptr, value->kind.data.integer.value};
+        } else if (loaded.count(value)) {
+          op = {PreOperandKind::kVar, loaded[value], 0};
+        } else if (known.count(value)) {
+          op = {PreOperandKind::kExpr, nullptr, known[value]};
+        } else {
+          return false;
+        }
+        return true;
+      };
+      for (auto inst : Insts(blocks_[b])) {
+        const auto &kind = inst->kind;
+        PreOperand lhs, rhs;
+        if (kind.tag == KOOPA_RVT_LOAD) {
+          loaded[inst] = kind.data.load.src;
+        } else if (kind.tag == KOOPA_RVT_BINARY && operand(kind.data.binary.lhs, lhs) &&
+                   operand(kind.data.binary.rhs, rhs)) {
+          PreExpr node{kind.data.binary.op, lhs, rhs};
+          auto it = ids.find(node);
+          if (it == ids.end()) {
+            it = ids.emplace(node, nodes_.size()).first;
+            AddNode(node, leaf);
+          }
+          known[inst] = it->second;
+          if (node_expr_[it->second] >= 0) {
+            occurrence_[inst] = node_expr_[it->second];
+            events_[b].push_back(inst);
+          }
+        }
+        auto kills = Kills(inst);
+        for (auto var : kills) {
+          for (auto it = loaded.begin(); it != loaded.end();) {
+            it = it->second == var ? loaded.erase(it) : std::next(it);
+          }
+          for (auto it = known.begin(); it != known.end();) {
+            const auto &vars = node_vars_[it->second];
+            it = std::count(vars.begin(), vars.end(), var) ? known.erase(it) : std::next(it);
+          }
+        }
+        if (!kills.empty() || IsBarrier(inst)) {
+          events_[b].push_back(inst);
+        }
+      }
+    }
+  }
+
+  void AddNode(const PreExpr &node, bool leaf) {
+    size_t id = nodes_.size();
+    nodes_.push_back(node);
+    std::vector<koopa_raw_value_t> vars;
+    for (const auto &op : {std::get<1>(node), std::get<2>(node)}) {
+      if (std::get<0>(op) == PreOperandKind::kVar) {
+        vars.push_back(std::get<1>(op));
+      } else if (std::get<0>(op) == PreOperandKind::kExpr) {
+        const auto &sub = node_vars_[std::get<2>(op)];
+        vars.insert(vars.end(), sub.begin(), sub.end());
+      }
+    }
+    std::sort(vars.begin(), vars.end());
+    vars.erase(std::unique(vars.begin(), vars.end()), vars.end());
+    node_vars_.push_back(vars);
+    // 除数不是非零常量的除法和取模可能出错
+    const auto &[op, lhs, rhs] = node;
+    bool traps = (op == KOOPA_RBO_DIV || op == KOOPA_RBO_MOD) &&
+                 !(std::get<0>(rhs) == PreOperandKind::kConst && std::get<2>(rhs) != 0);
+    for (const auto &sub : {lhs, rhs}) {
+      traps = traps || (std::get<0>(sub) == PreOperandKind::kExpr && node_traps_[std::get<2>(sub)]);
+    }
+    node_traps_.push_back(traps);
+    node_expr_.push_back(-1);
+    if (IsPreCandidate(op, leaf)) {
+      node_expr_[id] = exprs_.size();
+      for (auto var : vars) {
+        uses_[var].push_back(exprs_.size());
+      }
+      if (traps) {
+        may_trap_.push_back(exprs_.size());
+      }
+      exprs_.push_back(id);
+    }
+  }
+
+  // 生成计算表达式的指令, 操作数重新 load
+  koopa_raw_value_t Emit(IRArena &arena, size_t node, std::vector<koopa_raw_value_t> &code) {
+    const auto &[op, lhs, rhs] = nodes_[node];
+    auto value = [&](const PreOperand &operand) -> koopa_raw_value_t {
+      const auto &[kind, var, v] = operand;
+      if (kind == PreOperandKind::kConst) {
+        return arena.Integer(v);
+      }
+      if (kind == PreOperandKind::kExpr) {
+        return Emit(arena, v, code);
+      }
+      auto load = arena.Load(var);
+      code.push_back(load);
+      return load;
+    };
+    auto l = value(lhs);
+    auto r = value(rhs);
+    auto result = arena.Binary(op, l, r);
+    code.push_back(result);
+    return result;
+  }
+
+  // 块内的性质: antloc 在块内第一次被改写之前算过, comp 在最后一次被改写之后算过,
+  // transp 操作数在块内没有被改写. 可能出错的表达式遇到 IsBarrier 的调用也不 transp,
+  // 这样不会被提前到调用之前; 之前算出的值在调用之后仍然可用, 所以 comp 不变
+  void ComputeLocal() {
+    size_t n = exprs_.size();
+    antloc_.assign(blocks_.size(), Bits(n, false));
+    comp_.assign(blocks_.size(), Bits(n, false));
+    transp_.assign(blocks_.size(), Bits(n, true));
+    for (size_t b = 0; b < blocks_.size(); b++) {
+      for (auto inst : events_[b]) {
+        auto it = occurrence_.find(inst);
+        if (it != occurrence_.end()) {
+          size_t e = it->second;
+          antloc_[b][e] = antloc_[b][e] || transp_[b][e];
+          comp_[b][e] = true;
+          continue;
+        }
+        for (auto var : Kills(inst)) {
+          for (size_t e : uses_[var]) {
+            transp_[b][e] = false;
+            comp_[b][e] = false;
+          }
+        }
+        if (IsBarrier(inst)) {
+          for (size_t e : may_trap_) {
+            transp_[b][e] = false;
+          }
+        }
+      }
+    }
+  }
+
+  // 对所有 in 求交, 没有 in 时为空
+  Bits Meet(const std::vector<size_t> &from, const std::vector<Bits> &sets) const {
+    if (from.empty()) {
+      return Bits(exprs_.size(), false);
+    }
+    Bits result = sets[from[0]];
+    for (size_t i = 1; i < from.size(); i++) {
+      for (size_t e = 0; e < result.size(); e++) {
+        result[e] = result[e] && sets[from[i]][e];
+      }
+    }
+    return result;
+  }
+
+  void ComputeGlobal() {
+    size_t n = exprs_.size(), nblocks = blocks_.size();
+    // 可用: 每条到达块尾的路径上都算过
+    std::vector<Bits> avail_out(nblocks, Bits(n, true));
+    // 预期: 从块首出发的每条路径上都会在操作数被改写之前算
+    std::vector<Bits> ant_in(nblocks, Bits(n, true));
+    ant_out_.assign(nblocks, Bits(n, false));
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (size_t b = 0; b < nblocks; b++) {
+        Bits in = b == 0 ? Bits(n, false) : Meet(preds_[b], avail_out);
+        Bits out(n);
+        for (size_t e = 0; e < n; e++) {
+          out[e] = comp_[b][e] || (in[e] && transp_[b][e]);
+        }
+        changed |= out != avail_out[b];
+        avail_out[b] = out;
+      }
+      for (size_t b = nblocks; b-- > 0;) {
+        Bits out = Meet(succs_[b], ant_in);
+        Bits in(n);
+        for (size_t e = 0; e < n; e++) {
+          in[e] = antloc_[b][e] || (out[e] && transp_[b][e]);
+        }
+        changed |= in != ant_in[b] || out != ant_out_[b];
+        ant_in[b] = in;
+        ant_out_[b] = out;
+      }
+    }
+    // earliest(p, s): 在这条边上算是安全的, 而且不能再早了
+    auto earliest = [&](size_t p, size_t s) {
+      Bits result(n);
+      for (size_t e = 0; e < n; e++) {
+        result[e] = ant_in[s][e] && !avail_out[p][e] && (!transp_[p][e] || !ant_out_[p][e]);
+      }
+      return result;
+    };
+    // later(p, s): 可以推迟到这条边之后再算. 入口前的虚拟边上 later 就是 earliest
+    laterin_.assign(nblocks, Bits(n, true));
+    laterin_[0] = ant_in[0];
+    auto later = [&](size_t p, size_t s) {
+      Bits result = earliest(p, s);
+      for (size_t e = 0; e < n; e++) {
+        result[e] = result[e] || (laterin_[p][e] && !antloc_[p][e]);
+      }
+      return result;
+    };
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (size_t b = 1; b < nblocks; b++) {
+        Bits in(n, !preds_[b].empty());
+        for (size_t p : preds_[b]) {
+          Bits l = later(p, b);
+          for (size_t e = 0; e < n; e++) {
+            in[e] = in[e] && l[e];
+          }
+        }
+        changed |= in != laterin_[b];
+        laterin_[b] = in;
+      }
+    }
+    for (size_t p = 0; p < nblocks; p++) {
+      for (size_t s : succs_[p]) {
+        Bits l = later(p, s);
+        for (size_t e = 0; e < n; e++) {
+          if (l[e] && !laterin_[s][e]) {
+            inserts_[{p, s}].push_back(e);
+          }
+        }
+      }
+    }
+  }
+
+  bool Transform(IRArena &arena) {
+    size_t n = exprs_.size(), nblocks = blocks_.size();
+    // 要补算或者删除重复计算的表达式才需要临时变量
+    std::vector<koopa_raw_value_t> temps(n, nullptr);
+    for (const auto &[edge, exprs] : inserts_) {
+      for (size_t e : exprs) {
+        temps[e] = temps[e] ? temps[e] : arena.Alloc();
+      }
+    }
+    for (size_t b = 0; b < nblocks; b++) {
+      for (size_t e = 0; e < n; e++) {
+        if (antloc_[b][e] && !laterin_[b][e] && !temps[e]) {
+          temps[e] = arena.Alloc();
+        }
+      }
+    }
+
+    std::unordered_map<koopa_raw_value_t, koopa_raw_value_t> replaced;
+    std::vector<std::vector<koopa_raw_value_t>> insts(nblocks);
+    bool changed = false;
+    for (size_t b = 0; b < nblocks; b++) {
+      // 块内表达式当前的值, 操作数被改写之后失效
+      std::unordered_map<size_t, koopa_raw_value_t> current;
+      Bits killed(n, false);
+      for (auto inst : Insts(blocks_[b])) {
+        auto it = occurrence_.find(inst);
+        if (it == occurrence_.end()) {
+          insts[b].push_back(inst);
+          for (auto var : Kills(inst)) {
+            for (size_t e : uses_[var]) {
+              current.erase(e);
+              killed[e] = true;
+            }
+          }
+          continue;
+        }
+        size_t e = it->second;
+        auto cur = current.find(e);
+        if (cur != current.end()) {
+          replaced[inst] = cur->second;
+          changed = true;
+          continue;
+        }
+        if (!killed[e] && antloc_[b][e] && !laterin_[b][e]) {
+          // 所有路径上都已经算过, 从临时变量里取
+          auto load = arena.Load(temps[e]);
+          insts[b].push_back(load);
+          replaced[inst] = load;
+          current[e] = load;
+          changed = true;
+          continue;
+        }
+        insts[b].push_back(inst);
+        current[e] = inst;
+        if (temps[e]) {
+          insts[b].push_back(arena.Store(inst, temps[e]));
+        }
+      }
+    }
+
+    // 在边上补算. 边的起点只有这一个后继时放在起点的末尾, 终点只有这一个前驱时放在终点的开头,
+    // 否则是关键边, 拆出一个新块
+    std::vector<koopa_raw_basic_block_t> new_blocks;
+    for (const auto &[edge, exprs] : inserts_) {
+      auto [p, s] = edge;
+      std::vector<koopa_raw_value_t> code;
+      for (size_t e : exprs) {
+        code.push_back(arena.Store(Emit(arena, exprs_[e], code), temps[e]));
+      }
+      if (succs_[p].size() == 1) {
+        insts[p].insert(insts[p].end() - 1, code.begin(), code.end());
+      } else if (preds_[s].size() == 1) {
+        insts[s].insert(insts[s].begin(), code.begin(), code.end());
+      } else {
+        koopa_raw_basic_block_t block = arena.NewBlock();
+        code.push_back(arena.Jump(blocks_[s]));
+        SetInsts(arena, block, code);
+        new_blocks.push_back(block);
+        auto &branch = Mut(insts[p].back())->kind.data.branch;
+        if (branch.true_bb == blocks_[s]) {
+          branch.true_bb = block;
+        }
+        if (branch.false_bb == blocks_[s]) {
+          branch.false_bb = block;
+        }
+      }
+      changed = true;
+    }
+    if (!changed) {
+      return false;
+    }
+    for (auto temp : temps) {
+      if (temp) {
+        insts[0].insert(insts[0].begin(), temp);
+      }
+    }
+    for (size_t b = 0; b < nblocks; b++) {
+      SetInsts(arena, blocks_[b], insts[b]);
+    }
+    AddBlocks(arena, func_, new_blocks);
+    ReplaceUses(func_, replaced);
+    RemoveUnusedValues(arena, func_);
+    return true;
+  }
+
+  koopa_raw_function_t func_;
+  const ModRefAnalysis &modref_;
+  std::vector<koopa_raw_basic_block_t> blocks_;
+  std::unordered_map<koopa_raw_basic_block_t, size_t> index_;
+  std::vector<std::vector<size_t>> preds_, succs_;
+  // 所有出现过的表达式 (包括子表达式), 各自用到的变量, 和它是第几个要移动的表达式 (-1 表示不移动)
+  std::vector<PreExpr> nodes_;
+  std::vector<std::vector<koopa_raw_value_t>> node_vars_;
+  std::vector<int> node_expr_;
+  // 每个表达式是否可能出错, 以及可能出错的要移动的表达式
+  std::vector<bool> node_traps_;
+  std::vector<size_t> may_trap_;
+  // 要移动的表达式 -> 表达式编号
+  std::vector<size_t> exprs_;
+  // 变量 -> 用到它的表达式
+  std::unordered_map<koopa_raw_value_t, std::vector<size_t>> uses_;
+  // 表达式的计算 -> 表达式
+  std::unordered_map<koopa_raw_value_t, size_t> occurrence_;
+  // 每个块里的表达式计算和改写变量的指令
+  std::vector<std::vector<koopa_raw_value_t>> events_;
+  std::vector<Bits> antloc_, comp_, transp_, ant_out_, laterin_;
+  // 边 (前驱, 后继) 上要补算的表达式
+  std::map<std::pair<size_t, size_t>, std::vector<size_t>> inserts_;
+};
+
+static bool EliminatePartialRedundancy(IRArena &arena, koopa_raw_function_t func,
+                                       const ModRefAnalysis &modref) {
+  return PartialRedundancy(func, modref).Run(arena);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "DeadCode.hpp"
+#include "Globals.hpp"
+#include "IR.hpp"
+#include "IfConvert.hpp"
+#include "Interpreter.hpp"
+#include "KnownBits.hpp"
+#include "ModRef.hpp"
+#include "PRE.hpp"
+#include "Promote.hpp"
+#include "Schedule.hpp"
+#include "Simplify.hpp"
+#include "Sink.hpp"
+#include "Specialize.hpp"
+#include "Switch.hpp"
+
+// 后端之前在 raw program 上运行的与目标无关的优化, 直接修改 raw program.
+// 和代价相关的决定 (比如 if-conversion) 参考目标 CPU 的延迟表
+
+// 代数化简, 然后用已知位化简, 之后可能又出现新的常量和恒等式
+static void SimplifyAll(IRArena &arena, koopa_raw_function_t func, const ModRefAnalysis &modref) {
+  SimplifyFunction(arena, func, modref);
+  if (SimplifyKnownBits(arena, func)) {
+    SimplifyFunction(arena, func, modref);
+  }
+}
+
+static void OptimizeProgram(IRArena &arena, koopa_raw_program_t &program, const CpuModel &cpu) {
+  // 不读输入的程序直接在编译期跑完
+  EvaluateProgram(arena, program);
+  // 先把常量全局变量换成初始值, 副作用分析里就不会再有对它们的读
+  PropagateConstantGlobals(arena, program);
+  SpecializeFunctions(arena, program);
+  // 优化只会删掉读写, 一开始算出的副作用一直是保守的
+  ModRefAnalysis modref(program);
+  CallFolder folder(modref);
+  for (size_t f = 0; f < program.funcs.len; f++) {
+    auto func = SliceAt<koopa_raw_function_t>(program.funcs, f);
+    if (func->bbs.len == 0) {
+      continue;
+    }
+    SimplifyAll(arena, func, modref);
+    if (folder.Fold(arena, func)) {
+      SimplifyAll(arena, func, modref);
+    }
+    if (HoistPureCalls(arena, func, modref)) {
+      SimplifyAll(arena, func, modref);
+    }
+    // 调用提出循环之后可能有更多的全局变量可以替换
+    if (PromoteGlobals(arena, func, modref)) {
+      SimplifyAll(arena, func, modref);
+    }
+    if (EliminatePartialRedundancy(arena, func, modref)) {
+      SimplifyAll(arena, func, modref);
+    }
+    if (IfConvertFunction(arena, func, cpu)) {
+      SimplifyAll(arena, func, modref);
+    }
+    LowerSwitches(arena, func);
+    // 剩下的分支里, 把只在一边用到的计算挪进去
+    if (SinkCode(arena, func, modref)) {
+      SimplifyAll(arena, func, modref);
+    }
+    if (EliminateDeadStores(arena, func, modref)) {
+      RemoveUnusedValues(arena, func);
+    }
+    EliminateDeadCode(arena, func, modref);
+  }
+  RemoveDeadArguments(arena, program, modref);
+  // 优化删掉的调用可能让一些函数再也调用不到, 只在它们里面用到的全局变量也随之删掉
+  RemoveDeadFunctions(arena, program);
+  RemoveUnusedGlobals(arena, program);
+  RebuildUsedBy(arena, program);
+}
@@ -0,0 +1,288 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "MIR.hpp"
+
+// 寄存器分配之后在 MachineInstr 上做的窥孔优化. 每条规则命中一次计数一次,
+// 编译结束时由 main 打印出来
+
+enum PeepholeRule {
+  kStoreLoadForward,  // sw r, X; ...; lw d, X  =>  mv d, r (d == r 时直接删掉)
+  kRedundantMove,     // mv r, r 或者 r 里已经是同一个值的 mv
+  kZeroRegister,      // li r, 0 之后对 r 的使用直接读 x0
+  kDeadDef,           // 结果不再被使用的指令
+  kJumpToNext,        // j 到紧跟着的下一个块
+  kBranchInversion,   // bcc L1; j L2; L1:  =>  b!cc L2
+  kNumPeepholeRules,
+};
+
+static const char *peephole_rule_names[] = {
+    "store-load-forward", "redundant-move", "zero-register",
+    "dead-def",           "jump-to-next",   "branch-inversion"};
+
+struct PeepholeStats {
+  int hits[kNumPeepholeRules] = {};
+
+  void Dump(std::ostream &os) const {
+    for (int i = 0; i < kNumPeepholeRules; i++) {
+      os << "peephole " << peephole_rule_names[i] << ": " << hits[i] << "\n";
+    }
+  }
+};
+
+static bool HasSideEffect(const MachineInstr &inst) {
+  switch (inst.op) {
+    case MOp::kSw:
+    case MOp::kCall:
+    case MOp::kRet:
+    case MOp::kJ:
+    case MOp::kJr:
+      return true;
+    default:
+      return inst.IsBranch();
+  }
+}
+
+// 块内向前扫描, 记住每个栈上 slot / 全局变量当前的值在哪个寄存器里, 哪些寄存器是 0,
+// 哪些寄存器互为拷贝. 写寄存器时让相关的记录失效
+class ForwardScan {
+ public:
+  // 栈上 slot 用 sp 的偏移, 全局变量用符号名
+  using Slot = std::pair<int, std::string>;
+
+  explicit ForwardScan(PeepholeStats &stats) : stats_(stats) {}
+
+  bool Run(MachineBasicBlock &mbb) {
+    available_.clear();
+    zero_ = RegSet();
+    copies_.clear();
+    bool changed = false;
+    std::vector<MachineInstr> out;
+    for (MachineInstr inst : mbb.insts) {
+      changed |= PropagateZero(inst);
+      if (inst.op == MOp::kLw && (!inst.sym.empty() || IsSpSlot(inst))) {
+        auto it = available_.find(SlotOf(inst));
+        if (it != available_.end()) {
+          stats_.hits[kStoreLoadForward]++;
+          changed = true;
+          if (it->second == inst.rd) {
+            continue;
+          }
+          inst = MachineInstr{.op = MOp::kMv, .rd = inst.rd, .rs1 = it->second};
+        }
+      }
+      if (inst.op == MOp::kMv && (inst.rd == inst.rs1 || SameValue(inst.rd, inst.rs1))) {
+        stats_.hits[kRedundantMove]++;
+        changed = true;
+        continue;
+      }
+      Update(inst);
+      out.push_back(inst);
+    }
+    mbb.insts = std::move(out);
+    return changed;
+  }
+
+ private:
+  PeepholeStats &stats_;
+  std::map<Slot, int> available_;
+  RegSet zero_;
+  std::vector<std::pair<int, int>> copies_;
+
+  static bool IsSpSlot(const MachineInstr &inst) {
+    return inst.sym.empty() && inst.rs1 == kSp;
+  }
+
+  static Slot SlotOf(const MachineInstr &inst) {
+    if (!inst.sym.empty()) {
+      return {0, inst.sym};
+    }
+    return {inst.imm, ""};
+  }
+
+  bool SameValue(int a, int b) const {
+    for (const auto &[x, y] : copies_) {
+      if ((x == a && y == b) || (x == b && y == a)) {
+        return true;
+      }
+    }
+    return zero_.test(a) && zero_.test(b);
+  }
+
+  bool PropagateZero(MachineInstr &inst) {
+    bool changed = false;
+    std::vector<int> uses = inst.Uses();
+    for (int *reg : {&inst.rs1, &inst.rs2}) {
+      bool used = std::find(uses.begin(), uses.end(), *reg) != uses.end();
+      if (*reg > 0 && zero_.test(*reg) && used) {
+        *reg = 0;
+        stats_.hits[kZeroRegister]++;
+        changed = true;
+      }
+    }
+    return changed;
+  }
+
+  void Kill(int reg) {
+    zero_.reset(reg);
+    for (auto it = available_.begin(); it != available_.end();) {
+      if (it->second == reg) {
+        it = available_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    for (size_t i = 0; i < copies_.size();) {
+      if (copies_[i].first == reg || copies_[i].second == reg) {
+        copies_.erase(copies_.begin() + i);
+      } else {
+        i++;
+      }
+    }
+  }
+
+  void Update(const MachineInstr &inst) {
+    if (inst.op == MOp::kSw) {
+      if (!inst.sym.empty() || IsSpSlot(inst)) {
+        available_.erase(SlotOf(inst));
+      } else {
+        // 基址不是 sp 的 slot (大偏移), 不知道写了哪里
+        ForgetStack();
+      }
+    }
+    if (inst.op == MOp::kCall) {
+      // 被调用的函数可能写全局变量, 但不会写我们的栈帧
+      for (auto it = available_.begin(); it != available_.end();) {
+        if (!it->first.second.empty()) {
+          it = available_.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+    for (int reg : inst.Defs()) {
+      if (reg == kSp) {
+        ForgetStack();
+      }
+      Kill(reg);
+    }
+    switch (inst.op) {
+      case MOp::kSw:
+        if (!inst.sym.empty() || IsSpSlot(inst)) {
+          available_[SlotOf(inst)] = inst.rs2;
+        }
+        break;
+      case MOp::kLw:
+        if ((!inst.sym.empty() || IsSpSlot(inst)) && inst.rd != inst.rs1) {
+          available_[SlotOf(inst)] = inst.rd;
+        }
+        break;
+      case MOp::kLi:
+        if (inst.imm == 0) {
+          zero_.set(inst.rd);
+        }
+        break;
+      case MOp::kMv:
+        if (inst.rs1 == 0) {
+          zero_.set(inst.rd);
+        } else {
+          copies_.push_back({inst.rd, inst.rs1});
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  void ForgetStack() {
+    for (auto it = available_.begin(); it != available_.end();) {
+      if (it->first.second.empty()) {
+        it = available_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+};
+
+// 倒着扫描每个块, 删掉没有副作用且结果不再活跃的指令
+static bool RemoveDeadDefs(MachineFunction &mf, PeepholeStats &stats) {
+  bool changed = false;
+  std::vector<RegSet> live_out = ComputeLiveOut(mf);
+  for (size_t b = 0; b < mf.blocks.size(); b++) {
+    auto &insts = mf.blocks[b].insts;
+    RegSet live = live_out[b];
+    live.set(kSp);
+    std::vector<MachineInstr> kept;
+    for (size_t i = insts.size(); i-- > 0;) {
+      const MachineInstr &inst = insts[i];
+      if (!HasSideEffect(inst) && !live.test(inst.rd)) {
+        stats.hits[kDeadDef]++;
+        changed = true;
+        continue;
+      }
+      StepBackward(live, inst);
+      live.set(kSp);
+      kept.push_back(inst);
+    }
+    insts.assign(kept.rbegin(), kept.rend());
+  }
+  return changed;
+}
+
+static MOp InvertBranch(MOp op) {
+  switch (op) {
+    case MOp::kBeqz: return MOp::kBnez;
+    case MOp::kBnez: return MOp::kBeqz;
+    case MOp::kBeq: return MOp::kBne;
+    case MOp::kBne: return MOp::kBeq;
+    case MOp::kBlt: return MOp::kBge;
+    case MOp::kBge: return MOp::kBlt;
+    case MOp::kBltu: return MOp::kBgeu;
+    case MOp::kBgeu: return MOp::kBltu;
+    default:
+      assert(false);
+      return op;
+  }
+}
+
+// 块末尾的跳转: 删掉到下一个块的 j, 能 fallthrough 时把条件跳转取反
+static bool SimplifyJumps(MachineFunction &mf, PeepholeStats &stats) {
+  bool changed = false;
+  for (size_t b = 0; b + 1 < mf.blocks.size(); b++) {
+    auto &insts = mf.blocks[b].insts;
+    const std::string &next = mf.blocks[b + 1].label;
+    size_t n = insts.size();
+    if (n >= 2 && insts[n - 1].op == MOp::kJ && insts[n - 2].IsBranch() &&
+        insts[n - 2].sym == next) {
+      insts[n - 2].op = InvertBranch(insts[n - 2].op);
+      insts[n - 2].sym = insts[n - 1].sym;
+      insts.pop_back();
+      stats.hits[kBranchInversion]++;
+      changed = true;
+    } else if (n >= 1 && insts[n - 1].op == MOp::kJ && insts[n - 1].sym == next) {
+      insts.pop_back();
+      stats.hits[kJumpToNext]++;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+static void RunPeephole(MachineFunction &mf, PeepholeStats &stats) {
+  ForwardScan scan(stats);
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto &mbb : mf.blocks) {
+      changed |= scan.Run(mbb);
+    }
+    changed |= RemoveDeadDefs(mf, stats);
+    changed |= SimplifyJumps(mf, stats);
+  }
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <algorithm>
+#include <unordered_set>
+#include <vector>
+#include "IR.hpp"
+#include "Loop.hpp"
+#include "ModRef.hpp"
+
+// 循环里全局变量的标量替换. 没有指针, 全局变量不会有别名, 循环里没有 call 读写全局变量 g 时,
+// 在 preheader 里把 g 读进一个新的局部变量, 循环里对 g 的读写都换成这个局部变量,
+// 离开循环 (包括在循环里 ret) 之前再写回 g. 局部变量在后端可以放进寄存器, 至少也是按 sp 的
+// 偏移访问, 不用每次都先算出全局变量的地址
+
+// 循环里所有对 var 的 load/store 改成对 local 的, 返回是否有 store
+static bool RedirectAccesses(const Loop &loop, koopa_raw_value_t var, koopa_raw_value_t local) {
+  bool stored = false;
+  for (auto bb : loop.blocks) {
+    for (auto inst : Insts(bb)) {
+      auto &kind = Mut(inst)->kind;
+      if (kind.tag == KOOPA_RVT_LOAD && kind.data.load.src == var) {
+        kind.data.load.src = local;
+      } else if (kind.tag == KOOPA_RVT_STORE && kind.data.store.dest == var) {
+        kind.data.store.dest = local;
+        stored = true;
+      }
+    }
+  }
+  return stored;
+}
+
+static bool PromoteLoopGlobals(IRArena &arena, koopa_raw_function_t func, const Loop &loop,
+                               const ModRefAnalysis &modref) {
+  std::vector<koopa_raw_value_t> globals;
+  std::unordered_set<koopa_raw_value_t> observed;
+  for (auto bb : loop.blocks) {
+    for (auto inst : Insts(bb)) {
+      const auto &kind = inst->kind;
+      koopa_raw_value_t var = nullptr;
+      if (kind.tag == KOOPA_RVT_LOAD) {
+        var = kind.data.load.src;
+      } else if (kind.tag == KOOPA_RVT_STORE) {
+        var = kind.data.store.dest;
+      } else if (kind.tag == KOOPA_RVT_CALL) {
+        const FunctionEffects &effects = modref.Get(inst);
+        observed.insert(effects.reads.begin(), effects.reads.end());
+        observed.insert(effects.writes.begin(), effects.writes.end());
+      }
+      if (var && ModRefAnalysis::IsGlobal(var) &&
+          std::find(globals.begin(), globals.end(), var) == globals.end()) {
+        globals.push_back(var);
+      }
+    }
+  }
+  globals.erase(std::remove_if(globals.begin(), globals.end(),
+                               [&](koopa_raw_value_t var) { return observed.count(var); }),
+                globals.end());
+  if (globals.empty()) {
+    return false;
+  }
+
+  auto entry = SliceAt<koopa_raw_basic_block_t>(func->bbs, 0);
+  std::vector<koopa_raw_value_t> entry_insts = Insts(entry);
+  std::vector<koopa_raw_value_t> preheader = Insts(loop.preheader);
+  auto term = preheader.back();
+  preheader.pop_back();
+  // 需要写回的 (全局变量, 局部变量)
+  std::vector<std::pair<koopa_raw_value_t, koopa_raw_value_t>> write_back;
+  for (auto var : globals) {
+    auto local = arena.Alloc();
+    entry_insts.insert(entry_insts.begin(), local);
+    auto value = arena.Load(var);
+    preheader.insert(preheader.end(), {value, arena.Store(value, local)});
+    if (RedirectAccesses(loop, var, local)) {
+      write_back.push_back({var, local});
+    }
+  }
+  preheader.push_back(term);
+  if (loop.preheader == entry) {
+    entry_insts.erase(entry_insts.begin() + globals.size(), entry_insts.end());
+    entry_insts.insert(entry_insts.end(), preheader.begin(), preheader.end());
+    SetInsts(arena, entry, entry_insts);
+  } else {
+    SetInsts(arena, entry, entry_insts);
+    SetInsts(arena, loop.preheader, preheader);
+  }
+  if (write_back.empty()) {
+    return true;
+  }
+
+  auto emit_write_back = [&](std::vector<koopa_raw_value_t> &insts) {
+    for (const auto &[var, local] : write_back) {
+      auto value = arena.Load(local);
+      insts.insert(insts.end(), {value, arena.Store(value, var)});
+    }
+  };
+  // 每条离开循环的边上插一个写回的块, 从别处到达出口的路径不受影响
+  std::vector<koopa_raw_basic_block_t> new_blocks;
+  auto split_exit = [&](koopa_raw_basic_block_t &target) {
+    if (loop.Contains(target)) {
+      return;
+    }
+    koopa_raw_basic_block_t block = arena.NewBlock();
+    std::vector<koopa_raw_value_t> insts;
+    emit_write_back(insts);
+    insts.push_back(arena.Jump(target));
+    SetInsts(arena, block, insts);
+    new_blocks.push_back(block);
+    target = block;
+  };
+  for (auto bb : loop.blocks) {
+    std::vector<koopa_raw_value_t> insts = Insts(bb);
+    auto &kind = Mut(insts.back())->kind;
+    if (kind.tag == KOOPA_RVT_JUMP) {
+      split_exit(kind.data.jump.target);
+    } else if (kind.tag == KOOPA_RVT_BRANCH) {
+      split_exit(kind.data.branch.true_bb);
+      split_exit(kind.data.branch.false_bb);
+    } else if (kind.tag == KOOPA_RVT_RETURN) {
+      auto ret = insts.back();
+      insts.pop_back();
+      emit_write_back(insts);
+      insts.push_back(ret);
+      SetInsts(arena, bb, insts);
+    }
+  }
+  AddBlocks(arena, func, new_blocks);
+  return true;
+}
+
+static bool PromoteGlobals(IRArena &arena, koopa_raw_function_t func,
+                           const ModRefAnalysis &modref) {
+  bool changed = false;
+  bool promoted = true;
+  // 先试外层循环, 外层替换掉之后内层就不再访问这个全局变量了. 改过 CFG 之后重新找循环
+  while (promoted) {
+    promoted = false;
+    std::vector<Loop> loops = FindLoops(arena, func);
+    for (auto it = loops.rbegin(); it != loops.rend() && !promoted; ++it) {
+      promoted = it->preheader && PromoteLoopGlobals(arena, func, *it, modref);
+    }
+    changed |= promoted;
+  }
+  return changed;
+}
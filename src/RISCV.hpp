@@ -1,21 +1,33 @@
 #pragma once
 
+#include <algorithm>
 #include <assert.h>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <iostream>
 #include <ostream>
 #include <regex>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 #include "ast.hpp"
 #include "koopa.h"
+#include "IR.hpp"
+#include "MIR.hpp"
+#include "Peephole.hpp"
+#include "Schedule.hpp"
+#include "Switch.hpp"
 
 // 函数声明略
 // ...
 
-static std::string reg_names[16] = {"x0", "t0", "t1", "t2", "t3", "t4", "t5", "t6", 
-                           "a0", "a1","a2","a3","a4","a5","a6","a7"};
+// t0-t2 留给虚拟寄存器 (生成单条 Koopa 指令时的临时值), 其余寄存器用来存放值 (见 PlanFrame)
+static const int kScratchRegs = 3;
+// 放进 .sdata/.sbss 的全局变量最大的字节数, 和 gcc 的 -msmall-data-limit 默认值相同
+static const int kSmallDataLimit = 8;
 struct Reg {
   int offset;
   bool stack;
@@ -26,11 +38,11 @@ struct Reg {
       return os;
   }
 
-  std::string to_string() {
+  std::string to_string() const {
     if (g != "") {
       return g;
     } else if (!stack) {
-      return reg_names[offset];
+      return IsVReg(offset) ? "%v" + std::to_string(offset - kFirstVReg) : reg_names[offset];
     } else {
       return std::to_string(offset) + "(sp)";
     }
@@ -38,50 +50,59 @@ struct Reg {
 };
 
 class RISCVEnvironemt {
-  private:
-    int reg_state[16] = {0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,-1, -1, -1};
   public:
     std::ostringstream code;
+    // 正在生成的函数, 指令追加到最后一个基本块
+    MachineFunction mf;
+    // 所有函数累计的窥孔优化命中次数
+    PeepholeStats peephole;
+    // 指令调度使用的延迟表, main 里按 -mcpu= 选择
+    const CpuModel *cpu = FindCpuModel("generic");
     std::unordered_map<koopa_raw_value_t, Reg> value_map;
     std::unordered_map<koopa_raw_basic_block_t, std::string> block_name;
+    // 当前函数中基本块的排布顺序, 以及正在生成的基本块下标
+    std::vector<koopa_raw_basic_block_t> layout;
+    size_t cur_block = 0;
+    // 只被紧随其后的 br 使用的比较, 不单独生成, 直接融合进条件跳转
+    std::unordered_set<koopa_raw_value_t> fused_cond;
+    // 用跳转表分发的比较链, 以链上的第一个块为键. 链上其余的块不生成代码
+    std::unordered_map<koopa_raw_basic_block_t, SwitchChain> jump_tables;
+
+    // 当前函数中每个值的位置 (寄存器或栈上的 slot), 由 PlanFrame 预先算好
+    std::unordered_map<koopa_raw_value_t, Reg> homes;
+    // 当前函数的栈帧大小, ra 的保存位置 (-1 表示不需要保存)
+    int frame_size = 0;
+    int ra = -1;
+    // 有多个 ret 且需要恢复栈帧时, 所有 ret 跳到同一个 epilogue, 否则为空
+    std::string epilogue;
+
+    // 小的全局变量放进 .sdata/.sbss, main 的入口处把 gp 设成 __global_pointer$.
+    // 只有链接时加上 --relax-gp, 读写它们的 lui + lw/sw 才会被松弛成一条相对 gp 的指令.
+    // 目前只有 run-s.sh 这样链接, 其他方式链接时仍然是两条指令, 结果一样
+    bool small_data = true;
 
     int zeroReg = 0;
     int retReg = 8;
     int stack_top = 0;
     int branch = 0;
-    int ra = 0;
-    int fp = 0;
     int global = 0;
+    int jump_table = 0;
 
+    // 临时值用虚拟寄存器, 函数生成完之后由 AllocateVRegs 分配到 t0-t2
     Reg FindReg() {
-      for (int i = 1; i < 16; i++) {
-        if (reg_state[i] == -1) {
-          SetRegBusy(i);
-          return Reg{i};
-        }
-      }
-      return Reg {-1};
+      return Reg{mf.NewVReg()};
+    }
+
+    void Emit(const MachineInstr &inst) {
+      mf.blocks.back().insts.push_back(inst);
     }
 
     Reg allocStack() {
       Reg r{.offset = stack_top, .stack = true};
-      stack_top -= 4;
+      stack_top += 4;
       return r;
     }
 
-    void SetRegBusy(int i) {
-      reg_state[i] = 1;
-    }
-
-    void SetRegFree(int i) {
-      reg_state[i] = -1;
-    }
-
-    void alloc(const koopa_raw_type_t &ty) {
-      int size = cal_size(ty);
-      stack_top -= size;
-    }
-
     int cal_size(const koopa_raw_type_t &ty) {
       if (ty->tag == KOOPA_RTT_UNIT) {
         return 0;
@@ -101,6 +122,14 @@ class RISCVEnvironemt {
       return name;
     }
 
+    // 下一个要生成的基本块, 跳转到它时可以直接 fallthrough
+    koopa_raw_basic_block_t NextBlock() {
+      if (cur_block + 1 < layout.size()) {
+        return layout[cur_block + 1];
+      }
+      return nullptr;
+    }
+
     std::string NewBlockName() {
       return "branch" + std::to_string(branch++);
     }
@@ -108,100 +137,184 @@ class RISCVEnvironemt {
     std::string NewGlobalName() {
       return "global" + std::to_string(global++);
     }
+
+    std::string NewJumpTableName() {
+      return "jumptable" + std::to_string(jump_table++);
+    }
 };
 
 class RISCVCodeGen {
   public:
-    static std::string emitMv(int destReg, int srcReg) {
-      return "\tmv " + reg_names[destReg] + ", " + reg_names[srcReg] + "\n";
+    static MachineInstr emitMv(int destReg, int srcReg) {
+      return MachineInstr{.op = MOp::kMv, .rd = destReg, .rs1 = srcReg};
+    }
+
+    static MachineInstr emitRet() {
+      return MachineInstr{.op = MOp::kRet};
+    }
+
+    static MachineInstr emitCall(std::string callee, int args) {
+      return MachineInstr{.op = MOp::kCall, .imm = args, .sym = callee};
+    }
+
+    static MachineInstr emitAddi(int destReg, int opReg, int num) {
+      return MachineInstr{.op = MOp::kAddi, .rd = destReg, .rs1 = opReg, .imm = num};
+    }
+
+    static MachineInstr emitAndi(int destReg, int opReg, int num) {
+      return MachineInstr{.op = MOp::kAndi, .rd = destReg, .rs1 = opReg, .imm = num};
+    }
+
+    static MachineInstr emitOri(int destReg, int opReg, int num) {
+      return MachineInstr{.op = MOp::kOri, .rd = destReg, .rs1 = opReg, .imm = num};
+    }
+
+    static MachineInstr emitXori(int destReg, int opReg, int num) {
+      return MachineInstr{.op = MOp::kXori, .rd = destReg, .rs1 = opReg, .imm = num};
+    }
+
+    static MachineInstr emitSlti(int destReg, int opReg, int num) {
+      return MachineInstr{.op = MOp::kSlti, .rd = destReg, .rs1 = opReg, .imm = num};
+    }
+
+    static MachineInstr emitSlli(int destReg, int opReg, int shamt) {
+      return MachineInstr{.op = MOp::kSlli, .rd = destReg, .rs1 = opReg, .imm = shamt};
+    }
+
+    static MachineInstr emitSrli(int destReg, int opReg, int shamt) {
+      return MachineInstr{.op = MOp::kSrli, .rd = destReg, .rs1 = opReg, .imm = shamt};
+    }
+
+    static MachineInstr emitSrai(int destReg, int opReg, int shamt) {
+      return MachineInstr{.op = MOp::kSrai, .rd = destReg, .rs1 = opReg, .imm = shamt};
+    }
+
+    static MachineInstr emitLui(int destReg, int num) {
+      return MachineInstr{.op = MOp::kLui, .rd = destReg, .imm = num};
+    }
+
+    static MachineInstr emitLi(int destReg, int num) {
+      return MachineInstr{.op = MOp::kLi, .rd = destReg, .imm = num};
+    }
+
+    static MachineInstr emitLa(int destReg, std::string symbol) {
+      return MachineInstr{.op = MOp::kLa, .rd = destReg, .sym = symbol};
+    }
+
+    static MachineInstr emitSeqz(int destReg, int opReg) {
+      return MachineInstr{.op = MOp::kSeqz, .rd = destReg, .rs1 = opReg};
+    }
+
+    static MachineInstr emitSnez(int destReg, int opReg) {
+      return MachineInstr{.op = MOp::kSnez, .rd = destReg, .rs1 = opReg};
+    }
+
+    static MachineInstr emitSlt(int destReg, int opReg1, int opReg2) {
+      return MachineInstr{.op = MOp::kSlt, .rd = destReg, .rs1 = opReg1, .rs2 = opReg2};
+    }
+
+    static MachineInstr emitSgt(int destReg, int opReg1, int opReg2) {
+      return MachineInstr{.op = MOp::kSgt, .rd = destReg, .rs1 = opReg1, .rs2 = opReg2};
+    }
+
+    static MachineInstr emitSub(int destReg, int opReg1, int opReg2) {
+      return MachineInstr{.op = MOp::kSub, .rd = destReg, .rs1 = opReg1, .rs2 = opReg2};
+    }
+
+    static MachineInstr emitAdd(int destReg, int opReg1, int opReg2) {
+      return MachineInstr{.op = MOp::kAdd, .rd = destReg, .rs1 = opReg1, .rs2 = opReg2};
     }
 
-    static std::string emitRet() {
-      return "\tret\n";
+    static MachineInstr emitMul(int destReg, int opReg1, int opReg2) {
+      return MachineInstr{.op = MOp::kMul, .rd = destReg, .rs1 = opReg1, .rs2 = opReg2};
     }
 
-    static std::string emitStackAddi(int offset) {
-      return "\taddi sp, sp, " + std::to_string(offset) + "\n";
+    static MachineInstr emitMulh(int destReg, int opReg1, int opReg2) {
+      return MachineInstr{.op = MOp::kMulh, .rd = destReg, .rs1 = opReg1, .rs2 = opReg2};
     }
 
-    static std::string emitLi(int destReg, int num) {
-      return "\tli " + reg_names[destReg] + ", " + std::to_string(num) + "\n"; 
+    static MachineInstr emitDiv(int destReg, int opReg1, int opReg2) {
+      return MachineInstr{.op = MOp::kDiv, .rd = destReg, .rs1 = opReg1, .rs2 = opReg2};
     }
 
-    static std::string emitSeqz(int destReg, int opReg) {
-      return "\tseqz " + reg_names[destReg] + ", " + reg_names[opReg] + "\n";
+    static MachineInstr emitRem(int destReg, int opReg1, int opReg2) {
+      return MachineInstr{.op = MOp::kRem, .rd = destReg, .rs1 = opReg1, .rs2 = opReg2};
     }
 
-    static std::string emitSnez(int destReg, int opReg) {
-      return "\tsnez " + reg_names[destReg] + ", " + reg_names[opReg] + "\n";
+    static MachineInstr emitAnd(int destReg, int opReg1, int opReg2) {
+      return MachineInstr{.op = MOp::kAnd, .rd = destReg, .rs1 = opReg1, .rs2 = opReg2};
     }
 
-    static std::string emitSlt(int destReg, int opReg1, int opReg2) {
-      return "\tslt " + reg_names[destReg] + ", " + reg_names[opReg1] + ", " + reg_names[opReg2] + "\n";
+    static MachineInstr emitOr(int destReg, int opReg1, int opReg2) {
+      return MachineInstr{.op = MOp::kOr, .rd = destReg, .rs1 = opReg1, .rs2 = opReg2};
     }
 
-    static std::string emitSgt(int destReg, int opReg1, int opReg2) {
-      return "\tsgt " + reg_names[destReg] + ", " + reg_names[opReg1] + ", " + reg_names[opReg2] + "\n";
+    static MachineInstr emitXor(int destReg, int opReg1, int opReg2) {
+      return MachineInstr{.op = MOp::kXor, .rd = destReg, .rs1 = opReg1, .rs2 = opReg2};
     }
 
-    static std::string emitSub(int destReg, int opReg1, int opReg2) {
-      return "\tsub " + reg_names[destReg] + ", " + reg_names[opReg1] + ", " + reg_names[opReg2] + "\n";
+    static MachineInstr emitSll(int destReg, int opReg1, int opReg2) {
+      return MachineInstr{.op = MOp::kSll, .rd = destReg, .rs1 = opReg1, .rs2 = opReg2};
     }
 
-    static std::string emitAdd(int destReg, int opReg1, int opReg2) {
-      return "\tadd " + reg_names[destReg] + ", " + reg_names[opReg1] + ", " + reg_names[opReg2] + "\n";
+    static MachineInstr emitSrl(int destReg, int opReg1, int opReg2) {
+      return MachineInstr{.op = MOp::kSrl, .rd = destReg, .rs1 = opReg1, .rs2 = opReg2};
     }
 
-    static std::string emitMul(int destReg, int opReg1, int opReg2) {
-      return "\tmul " + reg_names[destReg] + ", " + reg_names[opReg1] + ", " + reg_names[opReg2] + "\n";
+    static MachineInstr emitSra(int destReg, int opReg1, int opReg2) {
+      return MachineInstr{.op = MOp::kSra, .rd = destReg, .rs1 = opReg1, .rs2 = opReg2};
     }
 
-    static std::string emitDiv(int destReg, int opReg1, int opReg2) {
-      return "\tdiv " + reg_names[destReg] + ", " + reg_names[opReg1] + ", " + reg_names[opReg2] + "\n";
+    static MachineInstr emitSw(int srcReg, int baseReg, int offset) {
+      return MachineInstr{.op = MOp::kSw, .rs1 = baseReg, .rs2 = srcReg, .imm = offset};
     }
 
-    static std::string emitRem(int destReg, int opReg1, int opReg2) {
-      return "\trem " + reg_names[destReg] + ", " + reg_names[opReg1] + ", " + reg_names[opReg2] + "\n";
+    static MachineInstr emitSw(int srcReg, std::string symbol, int tempReg) {
+      return MachineInstr{.op = MOp::kSw, .rd = tempReg, .rs2 = srcReg, .sym = symbol};
     }
 
-    static std::string emitAnd(int destReg, int opReg1, int opReg2) {
-      return "\tand " + reg_names[destReg] + ", " + reg_names[opReg1] + ", " + reg_names[opReg2] + "\n";
+    static MachineInstr emitLw(int destReg, int baseReg, int offset) {
+      return MachineInstr{.op = MOp::kLw, .rd = destReg, .rs1 = baseReg, .imm = offset};
     }
 
-    static std::string emitOr(int destReg, int opReg1, int opReg2) {
-      return "\tor " + reg_names[destReg] + ", " + reg_names[opReg1] + ", " + reg_names[opReg2] + "\n";
+    static MachineInstr emitLw(int destReg, std::string symbol) {
+      return MachineInstr{.op = MOp::kLw, .rd = destReg, .sym = symbol};
     }
 
-    static std::string emitXor(int destReg, int opReg1, int opReg2) {
-      return "\txor " + reg_names[destReg] + ", " + reg_names[opReg1] + ", " + reg_names[opReg2] + "\n";
+    static MachineInstr emitBnez(int offset, std::string dest) {
+      return MachineInstr{.op = MOp::kBnez, .rs1 = offset, .sym = dest};
     }
 
-    static std::string emitSll(int destReg, int opReg1, int opReg2) {
-      return "\tsll " + reg_names[destReg] + ", " + reg_names[opReg1] + ", " + reg_names[opReg2] + "\n";
+    static MachineInstr emitBeqz(int offset, std::string dest) {
+      return MachineInstr{.op = MOp::kBeqz, .rs1 = offset, .sym = dest};
     }
 
-    static std::string emitSrl(int destReg, int opReg1, int opReg2) {
-      return "\tsrl " + reg_names[destReg] + ", " + reg_names[opReg1] + ", " + reg_names[opReg2] + "\n";
+    static MachineInstr emitBeq(int opReg1, int opReg2, std::string dest) {
+      return MachineInstr{.op = MOp::kBeq, .rs1 = opReg1, .rs2 = opReg2, .sym = dest};
     }
 
-    static std::string emitSra(int destReg, int opReg1, int opReg2) {
-      return "\tsra " + reg_names[destReg] + ", " + reg_names[opReg1] + ", " + reg_names[opReg2] + "\n";
+    static MachineInstr emitBne(int opReg1, int opReg2, std::string dest) {
+      return MachineInstr{.op = MOp::kBne, .rs1 = opReg1, .rs2 = opReg2, .sym = dest};
     }
 
-    static std::string emitSw(std::string src, std::string dest) {
-      return "\tsw " + src + ", " + dest + "\n";
+    static MachineInstr emitBlt(int opReg1, int opReg2, std::string dest) {
+      return MachineInstr{.op = MOp::kBlt, .rs1 = opReg1, .rs2 = opReg2, .sym = dest};
     }
 
-    static std::string emitLw(std::string src, std::string dest) {
-      return "\tlw " + src + ", " + dest + "\n";
+    static MachineInstr emitBge(int opReg1, int opReg2, std::string dest) {
+      return MachineInstr{.op = MOp::kBge, .rs1 = opReg1, .rs2 = opReg2, .sym = dest};
     }
 
-    static std::string emitBnez(int offset, std::string dest) {
-      return "\tbnez " + reg_names[offset] + ", " + dest + "\n";
+    static MachineInstr emitBgeu(int opReg1, int opReg2, std::string dest) {
+      return MachineInstr{.op = MOp::kBgeu, .rs1 = opReg1, .rs2 = opReg2, .sym = dest};
     }
 
-    static std::string emitJal(std::string dest) {
-      return "\tj " + dest + "\n";
+    static MachineInstr emitJr(int opReg, std::string table) {
+      return MachineInstr{.op = MOp::kJr, .rs1 = opReg, .sym = table};
+    }
+
+    static MachineInstr emitJal(std::string dest) {
+      return MachineInstr{.op = MOp::kJ, .sym = dest};
     }
 };
 
@@ -217,19 +330,660 @@ Reg Visit(RISCVEnvironemt &env, const koopa_raw_value_t &value);
 
 Reg Visit(RISCVEnvironemt &env, const koopa_raw_return_t &ret);
 Reg Visit(RISCVEnvironemt &envt, const koopa_raw_integer_t &val);
-Reg Visit(RISCVEnvironemt &env, const koopa_raw_binary_t &val);
-Reg Visit(RISCVEnvironemt &env, const koopa_raw_load_t &val);
+Reg Visit(RISCVEnvironemt &env, const koopa_raw_binary_t &val, Reg dest);
+Reg Visit(RISCVEnvironemt &env, const koopa_raw_load_t &val, Reg dest);
 Reg Visit(RISCVEnvironemt &env, const koopa_raw_store_t &val);
 Reg Visit(RISCVEnvironemt &env, const koopa_raw_branch_t &val);
 Reg Visit(RISCVEnvironemt &env, const koopa_raw_jump_t &val);
 Reg VisitFunCall(RISCVEnvironemt &env, const koopa_raw_slice_t &slice);
 
+// 后端看到的后继: 跳转表的第一个块直接跳到所有分支和 default
+static std::vector<koopa_raw_basic_block_t> BlockSuccessors(RISCVEnvironemt &env,
+                                                            koopa_raw_basic_block_t bb) {
+  auto it = env.jump_tables.find(bb);
+  if (it == env.jump_tables.end()) {
+    return Successors(bb);
+  }
+  std::vector<koopa_raw_basic_block_t> succs;
+  for (const auto &[k, target] : it->second.cases) {
+    succs.push_back(target);
+  }
+  succs.push_back(it->second.default_bb);
+  return succs;
+}
+
+// 基本块排布: 从入口开始, 每个块后面尽量紧跟它最可能的后继 (jump 的目标, br 的 true 分支,
+// 也就是 if 的 then 和 while 的循环体), 这样这条边就可以 fallthrough, 省掉一条 j.
+// 从入口不可达的块不会被排布, 也就不会生成代码.
+static std::vector<koopa_raw_basic_block_t> ComputeBlockLayout(RISCVEnvironemt &env,
+                                                               const koopa_raw_function_t &func) {
+  std::vector<koopa_raw_basic_block_t> layout;
+  std::unordered_set<koopa_raw_basic_block_t> placed;
+  std::vector<koopa_raw_basic_block_t> pending;
+  pending.push_back(reinterpret_cast<koopa_raw_basic_block_t>(func->bbs.buffer[0]));
+  while (!pending.empty()) {
+    koopa_raw_basic_block_t bb = pending.back();
+    pending.pop_back();
+    // 沿着最可能的后继一直排下去, 另一个后继留到这条链结束之后
+    while (bb != nullptr && !placed.count(bb)) {
+      placed.insert(bb);
+      layout.push_back(bb);
+      auto term = reinterpret_cast<koopa_raw_value_t>(bb->insts.buffer[bb->insts.len - 1]);
+      koopa_raw_basic_block_t next = nullptr;
+      if (env.jump_tables.count(bb)) {
+        // jr 没有 fallthrough, 按分支的顺序排布
+        std::vector<koopa_raw_basic_block_t> succs = BlockSuccessors(env, bb);
+        pending.insert(pending.end(), succs.rbegin(), succs.rend());
+      } else if (term->kind.tag == KOOPA_RVT_JUMP) {
+        next = term->kind.data.jump.target;
+      } else if (term->kind.tag == KOOPA_RVT_BRANCH) {
+        next = term->kind.data.branch.true_bb;
+        pending.push_back(term->kind.data.branch.false_bb);
+        if (placed.count(next)) {
+          next = term->kind.data.branch.false_bb;
+        }
+      }
+      bb = next;
+    }
+  }
+  return layout;
+}
+
+static std::vector<koopa_raw_value_t> Operands(const koopa_raw_value_t &inst) {
+  const auto &kind = inst->kind;
+  switch (kind.tag) {
+    case KOOPA_RVT_BINARY:
+      return {kind.data.binary.lhs, kind.data.binary.rhs};
+    case KOOPA_RVT_LOAD:
+      return {kind.data.load.src};
+    case KOOPA_RVT_STORE:
+      return {kind.data.store.value, kind.data.store.dest};
+    case KOOPA_RVT_BRANCH:
+      return {kind.data.branch.cond};
+    case KOOPA_RVT_RETURN:
+      if (kind.data.ret.value) {
+        return {kind.data.ret.value};
+      }
+      return {};
+    case KOOPA_RVT_CALL: {
+      std::vector<koopa_raw_value_t> args;
+      for (size_t i = 0; i < kind.data.call.args.len; i++) {
+        args.push_back(reinterpret_cast<koopa_raw_value_t>(kind.data.call.args.buffer[i]));
+      }
+      return args;
+    }
+    default:
+      return {};
+  }
+}
+
+// 生成代码时真正读取的操作数: 融合的比较没有操作数, 它的操作数算作在 br 处使用
+static std::vector<koopa_raw_value_t> UsedOperands(RISCVEnvironemt &env,
+                                                   const koopa_raw_value_t &inst) {
+  if (env.fused_cond.count(inst)) {
+    return {};
+  }
+  std::vector<koopa_raw_value_t> ops = Operands(inst);
+  if (inst->kind.tag == KOOPA_RVT_BRANCH && env.fused_cond.count(ops[0])) {
+    ops = Operands(ops[0]);
+  }
+  return ops;
+}
+
+// 每个块的循环嵌套深度. 前端生成的 CFG 都是可归约的, DFS 中指向栈上祖先的边就是回边,
+// 回边的源能不经过循环头到达的块都属于这个循环
+static std::vector<int> ComputeLoopDepth(RISCVEnvironemt &env,
+                                        const std::vector<koopa_raw_basic_block_t> &layout) {
+  std::unordered_map<koopa_raw_basic_block_t, size_t> index;
+  for (size_t i = 0; i < layout.size(); i++) {
+    index[layout[i]] = i;
+  }
+  std::vector<std::vector<size_t>> preds(layout.size());
+  for (size_t i = 0; i < layout.size(); i++) {
+    for (const auto &succ : BlockSuccessors(env, layout[i])) {
+      preds[index[succ]].push_back(i);
+    }
+  }
+  std::vector<int> depth(layout.size(), 0);
+  std::vector<int> state(layout.size(), 0);
+  std::vector<std::pair<size_t, size_t>> stack = {{0, 0}};
+  state[0] = 1;
+  while (!stack.empty()) {
+    auto &[b, k] = stack.back();
+    std::vector<koopa_raw_basic_block_t> succs = BlockSuccessors(env, layout[b]);
+    if (k == succs.size()) {
+      state[b] = 2;
+      stack.pop_back();
+      continue;
+    }
+    size_t s = index[succs[k++]];
+    if (state[s] == 0) {
+      state[s] = 1;
+      stack.push_back({s, 0});
+    } else if (state[s] == 1) {
+      std::vector<bool> in_loop(layout.size(), false);
+      std::vector<size_t> work = {b};
+      in_loop[s] = true;
+      while (!work.empty()) {
+        size_t x = work.back();
+        work.pop_back();
+        if (in_loop[x]) {
+          continue;
+        }
+        in_loop[x] = true;
+        for (size_t p : preds[x]) {
+          work.push_back(p);
+        }
+      }
+      for (size_t i = 0; i < layout.size(); i++) {
+        depth[i] += in_loop[i];
+      }
+    }
+  }
+  return depth;
+}
+
+// 一个值在 layout 中的定义位置和最后一次使用的位置
+struct ValueRange {
+  size_t block;
+  size_t def;
+  size_t last;
+  // 所有使用都在定义所在的块内, 且中间没有 call
+  bool local;
+};
+
+// 在 [def, last] 内活跃, 下一个值可以在 last 处重用同一个寄存器
+static bool LiveAt(const ValueRange &r, size_t pos) {
+  return r.def <= pos && (pos < r.last || pos == r.def);
+}
+
+// 栈上 slot 的共享: 先在 layout 的线性编号上算出每个变量的活跃区间 (alloc 以 store 为定义,
+// load 为使用; 跨块的部分由块级活跃性得到, 取所有活跃位置的外包区间), 区间不相交的变量
+// 共用一个 slot. 然后按 (循环深度加权的) 访问次数排序, 越常用的 slot 离 sp 越近,
+// 尽量让常用的访问落在 12 位立即数范围内. 返回每个变量的 slot 偏移, 从 base 开始.
+static std::unordered_map<koopa_raw_value_t, int> AssignStackSlots(
+    RISCVEnvironemt &env, const std::vector<koopa_raw_value_t> &vars, int base) {
+  std::unordered_map<koopa_raw_value_t, size_t> var_index;
+  for (size_t v = 0; v < vars.size(); v++) {
+    var_index[vars[v]] = v;
+  }
+  size_t nblocks = env.layout.size();
+  std::unordered_map<koopa_raw_basic_block_t, size_t> block_index;
+  std::vector<size_t> start(nblocks + 1, 0);
+  for (size_t b = 0; b < nblocks; b++) {
+    block_index[env.layout[b]] = b;
+    start[b + 1] = start[b] + env.layout[b]->insts.len;
+  }
+  std::vector<int> depth = ComputeLoopDepth(env, env.layout);
+
+  const size_t kNone = (size_t)-1;
+  std::vector<size_t> lo(vars.size(), kNone), hi(vars.size(), 0);
+  std::vector<long long> weight(vars.size(), 0);
+  auto touch = [&](size_t v, size_t pos, size_t b) {
+    lo[v] = std::min(lo[v], pos);
+    hi[v] = std::max(hi[v], pos);
+    long long w = 1;
+    for (int d = 0; d < std::min(depth[b], 5); d++) {
+      w *= 8;
+    }
+    weight[v] += w;
+  };
+  // 块内: 在定义之前的使用 (gen) 和定义 (kill)
+  std::vector<std::vector<bool>> gen(nblocks, std::vector<bool>(vars.size(), false));
+  std::vector<std::vector<bool>> kill(nblocks, std::vector<bool>(vars.size(), false));
+  for (size_t b = 0; b < nblocks; b++) {
+    const auto &insts = env.layout[b]->insts;
+    for (size_t j = 0; j < insts.len; j++) {
+      auto inst = reinterpret_cast<koopa_raw_value_t>(insts.buffer[j]);
+      for (const auto &op : UsedOperands(env, inst)) {
+        if (inst->kind.tag == KOOPA_RVT_STORE && op == inst->kind.data.store.dest) {
+          continue;
+        }
+        auto it = var_index.find(op);
+        if (it != var_index.end()) {
+          touch(it->second, start[b] + j, b);
+          if (!kill[b][it->second]) {
+            gen[b][it->second] = true;
+          }
+        }
+      }
+      koopa_raw_value_t def = inst;
+      if (inst->kind.tag == KOOPA_RVT_STORE) {
+        def = inst->kind.data.store.dest;
+      }
+      auto it = var_index.find(def);
+      // alloc 本身不是定义, 对它的 store 才是
+      if (it != var_index.end() &&
+          (def->kind.tag != KOOPA_RVT_ALLOC || inst->kind.tag == KOOPA_RVT_STORE)) {
+        touch(it->second, start[b] + j, b);
+        kill[b][it->second] = true;
+      }
+    }
+  }
+  // 块级活跃性
+  std::vector<std::vector<bool>> live_in(nblocks, std::vector<bool>(vars.size(), false));
+  std::vector<std::vector<bool>> live_out = live_in;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t b = nblocks; b-- > 0;) {
+      for (const auto &succ : BlockSuccessors(env, env.layout[b])) {
+        size_t sb = block_index[succ];
+        for (size_t v = 0; v < vars.size(); v++) {
+          if (live_in[sb][v] && !live_out[b][v]) {
+            live_out[b][v] = true;
+            changed = true;
+          }
+        }
+      }
+      for (size_t v = 0; v < vars.size(); v++) {
+        bool in = gen[b][v] || (live_out[b][v] && !kill[b][v]);
+        if (in && !live_in[b][v]) {
+          live_in[b][v] = true;
+          changed = true;
+        }
+      }
+    }
+  }
+  for (size_t b = 0; b < nblocks; b++) {
+    for (size_t v = 0; v < vars.size(); v++) {
+      if (live_in[b][v]) {
+        lo[v] = std::min(lo[v], start[b]);
+        hi[v] = std::max(hi[v], start[b]);
+      }
+      if (live_out[b][v]) {
+        lo[v] = std::min(lo[v], start[b + 1] - 1);
+        hi[v] = std::max(hi[v], start[b + 1] - 1);
+      }
+    }
+  }
+
+  // 按区间起点扫描, 区间已经结束的 slot 可以给后面的变量用
+  std::vector<size_t> order;
+  for (size_t v = 0; v < vars.size(); v++) {
+    if (lo[v] == kNone) {
+      lo[v] = hi[v] = 0;
+    }
+    order.push_back(v);
+  }
+  std::sort(order.begin(), order.end(), [&](size_t x, size_t y) { return lo[x] < lo[y]; });
+  std::vector<size_t> slot_of(vars.size());
+  std::vector<size_t> slot_end;
+  std::vector<long long> slot_weight;
+  for (size_t v : order) {
+    size_t slot = slot_end.size();
+    for (size_t k = 0; k < slot_end.size(); k++) {
+      if (slot_end[k] < lo[v]) {
+        slot = k;
+        break;
+      }
+    }
+    if (slot == slot_end.size()) {
+      slot_end.push_back(0);
+      slot_weight.push_back(0);
+    }
+    slot_end[slot] = hi[v];
+    slot_weight[slot] += weight[v];
+    slot_of[v] = slot;
+  }
+  std::vector<size_t> slots(slot_end.size());
+  for (size_t k = 0; k < slots.size(); k++) {
+    slots[k] = k;
+  }
+  std::stable_sort(slots.begin(), slots.end(),
+                   [&](size_t x, size_t y) { return slot_weight[x] > slot_weight[y]; });
+  std::vector<int> offset(slots.size());
+  for (size_t k = 0; k < slots.size(); k++) {
+    offset[slots[k]] = base + 4 * k;
+  }
+  std::unordered_map<koopa_raw_value_t, int> result;
+  for (size_t v = 0; v < vars.size(); v++) {
+    result[vars[v]] = offset[slot_of[v]];
+  }
+  env.stack_top = base + 4 * slots.size();
+  return result;
+}
+
+// 为当前函数规划每个值的位置和栈帧:
+// 1. 块内的临时值 (中间不跨 call) 按区间分配 t3-t6, 叶子函数还可以用空闲的 a 寄存器,
+//    call 的返回值直接留在 a0 里;
+// 2. 叶子函数的 alloc 整个函数占用一个寄存器, 参数的 alloc 直接用传参的寄存器,
+//    从寄存器 alloc 里 load 出的值在下次 store 之前直接使用这个寄存器;
+// 3. 放不下的值才分配栈上的 slot, 活跃区间不相交的值共用 slot (AssignStackSlots).
+//    所有值都在寄存器里的叶子函数没有栈帧.
+static void PlanFrame(RISCVEnvironemt &env, const koopa_raw_function_t &func) {
+  env.homes.clear();
+  bool has_call = false;
+  int out_args = 0;
+  int ret_count = 0;
+  std::unordered_map<koopa_raw_value_t, ValueRange> ranges;
+  std::vector<std::vector<size_t>> calls(env.layout.size());
+  std::vector<koopa_raw_value_t> allocs;
+  std::unordered_map<koopa_raw_value_t, int> alloc_uses;
+  for (size_t b = 0; b < env.layout.size(); b++) {
+    const auto &insts = env.layout[b]->insts;
+    for (size_t j = 0; j < insts.len; j++) {
+      auto inst = reinterpret_cast<koopa_raw_value_t>(insts.buffer[j]);
+      if (inst->kind.tag == KOOPA_RVT_CALL) {
+        has_call = true;
+        calls[b].push_back(j);
+        out_args = std::max(out_args, (int)inst->kind.data.call.args.len - 8);
+      } else if (inst->kind.tag == KOOPA_RVT_RETURN) {
+        ret_count++;
+      } else if (inst->kind.tag == KOOPA_RVT_ALLOC) {
+        allocs.push_back(inst);
+        alloc_uses[inst] = 0;
+        continue;
+      }
+      if (env.cal_size(inst->ty) > 0 && !env.fused_cond.count(inst)) {
+        ranges[inst] = ValueRange{b, j, j, true};
+      }
+    }
+  }
+  // 第一次 call 之后传参寄存器就被破坏了, 之后还要用的参数需要另找位置
+  size_t first_call = calls[0].empty() ? env.layout[0]->insts.len : calls[0][0];
+  std::vector<koopa_raw_value_t> clobbered_args;
+  for (size_t b = 0; b < env.layout.size(); b++) {
+    const auto &insts = env.layout[b]->insts;
+    for (size_t j = 0; j < insts.len; j++) {
+      auto inst = reinterpret_cast<koopa_raw_value_t>(insts.buffer[j]);
+      for (const auto &op : UsedOperands(env, inst)) {
+        if (op->kind.tag == KOOPA_RVT_FUNC_ARG_REF && op->kind.data.func_arg_ref.index < 8 &&
+            has_call && (b > 0 || j > first_call)) {
+          if (std::find(clobbered_args.begin(), clobbered_args.end(), op) ==
+              clobbered_args.end()) {
+            clobbered_args.push_back(op);
+          }
+          continue;
+        }
+        if (alloc_uses.count(op)) {
+          alloc_uses[op]++;
+          continue;
+        }
+        auto it = ranges.find(op);
+        if (it == ranges.end()) {
+          continue;
+        }
+        ValueRange &r = it->second;
+        if (b != r.block || j < r.def) {
+          r.local = false;
+        } else {
+          r.last = std::max(r.last, j);
+        }
+      }
+    }
+  }
+  // call 会破坏 caller-saved 寄存器, 跨过 call 的值只能放在栈上
+  for (auto &[value, r] : ranges) {
+    for (size_t c : calls[r.block]) {
+      if (r.def < c && c < r.last) {
+        r.local = false;
+      }
+    }
+  }
+  // 返回值在下一次 call 之前用完的话就一直留在 a0 里. 非叶子函数里只有 call,
+  // 传参 (并行拷贝, 见 VisitFunCall) 和 ret 会写 a0
+  for (const auto &[value, r] : ranges) {
+    if (r.local && value->kind.tag == KOOPA_RVT_CALL) {
+      env.homes[value] = Reg{.offset = env.retReg};
+    }
+  }
+
+  std::vector<int> pool = {4, 5, 6, 7};
+  if (!has_call) {
+    for (int i = 15; i >= 8 + (int)std::min<size_t>(func->params.len, 8); i--) {
+      pool.push_back(i);
+    }
+    // 参数的 alloc 直接放在传参的寄存器里, 入口处的 store 就什么也不用做了
+    auto entry = env.layout[0];
+    for (size_t j = 0; j < entry->insts.len; j++) {
+      auto inst = reinterpret_cast<koopa_raw_value_t>(entry->insts.buffer[j]);
+      if (inst->kind.tag != KOOPA_RVT_STORE) {
+        continue;
+      }
+      auto value = inst->kind.data.store.value;
+      auto dest = inst->kind.data.store.dest;
+      if (value->kind.tag == KOOPA_RVT_FUNC_ARG_REF && value->kind.data.func_arg_ref.index < 8 &&
+          value->used_by.len == 1 && alloc_uses.count(dest) && !env.homes.count(dest)) {
+        env.homes[dest] = Reg{.offset = 8 + (int)value->kind.data.func_arg_ref.index};
+      }
+    }
+    // 其余的 alloc 按使用次数依次分配寄存器, 但要给临时值留下足够的寄存器
+    size_t pressure = 0;
+    for (size_t b = 0; b < env.layout.size(); b++) {
+      for (size_t j = 0; j < env.layout[b]->insts.len; j++) {
+        size_t live = 0;
+        for (const auto &[value, r] : ranges) {
+          if (r.local && r.block == b && LiveAt(r, j)) {
+            live++;
+          }
+        }
+        pressure = std::max(pressure, live);
+      }
+    }
+    std::stable_sort(allocs.begin(), allocs.end(),
+                     [&](koopa_raw_value_t a, koopa_raw_value_t b) {
+                       return alloc_uses[a] > alloc_uses[b];
+                     });
+    for (const auto &alloc : allocs) {
+      if (env.homes.count(alloc)) {
+        continue;
+      }
+      if (pool.size() <= pressure) {
+        break;
+      }
+      env.homes[alloc] = Reg{.offset = pool.back()};
+      pool.pop_back();
+    }
+    // 从寄存器 alloc 里 load 出的值, 在下一次 store 之前都可以直接用 alloc 的寄存器
+    for (auto &[value, r] : ranges) {
+      if (!r.local || value->kind.tag != KOOPA_RVT_LOAD) {
+        continue;
+      }
+      auto src = value->kind.data.load.src;
+      if (!env.homes.count(src)) {
+        continue;
+      }
+      bool stored = false;
+      const auto &insts = env.layout[r.block]->insts;
+      for (size_t j = r.def + 1; j < r.last; j++) {
+        auto inst = reinterpret_cast<koopa_raw_value_t>(insts.buffer[j]);
+        if (inst->kind.tag == KOOPA_RVT_STORE && inst->kind.data.store.dest == src) {
+          stored = true;
+        }
+      }
+      if (!stored) {
+        env.homes[value] = env.homes[src];
+      }
+    }
+  }
+
+  // 块内的临时值按定义顺序分配寄存器, 区间结束后寄存器可以再分配给后面的值
+  std::vector<koopa_raw_value_t> spills;
+  for (size_t b = 0; b < env.layout.size(); b++) {
+    std::vector<std::pair<ValueRange, koopa_raw_value_t>> block_ranges;
+    for (const auto &[value, r] : ranges) {
+      if (r.block != b || env.homes.count(value)) {
+        continue;
+      }
+      if (r.local) {
+        block_ranges.push_back({r, value});
+      } else {
+        spills.push_back(value);
+      }
+    }
+    std::sort(block_ranges.begin(), block_ranges.end(),
+              [](const auto &x, const auto &y) { return x.first.def < y.first.def; });
+    std::vector<int> free_regs = pool;
+    std::vector<std::pair<size_t, int>> active;
+    for (const auto &[r, value] : block_ranges) {
+      for (size_t k = 0; k < active.size();) {
+        if (active[k].first <= r.def) {
+          free_regs.push_back(active[k].second);
+          active.erase(active.begin() + k);
+        } else {
+          k++;
+        }
+      }
+      if (free_regs.empty()) {
+        spills.push_back(value);
+        continue;
+      }
+      int reg = free_regs.back();
+      free_regs.pop_back();
+      env.homes[value] = Reg{.offset = reg};
+      active.push_back({r.last, reg});
+    }
+  }
+
+  // 栈帧自底向上: 第 9 个以后的传出参数, ra, alloc 和放不下的值
+  int size = out_args * 4;
+  env.ra = -1;
+  if (has_call) {
+    env.ra = size;
+    size += 4;
+  }
+  for (const auto &alloc : allocs) {
+    if (!env.homes.count(alloc)) {
+      spills.push_back(alloc);
+    }
+  }
+  // 这些参数在 prologue 里存到栈上
+  spills.insert(spills.end(), clobbered_args.begin(), clobbered_args.end());
+  for (const auto &[value, offset] : AssignStackSlots(env, spills, size)) {
+    env.homes[value] = Reg{.offset = offset, .stack = true};
+  }
+  size = env.stack_top;
+  // 栈指针保持 16 字节对齐
+  env.frame_size = (size + 15) / 16 * 16;
+  env.epilogue = "";
+  if (env.frame_size > 0 && ret_count > 1) {
+    env.epilogue = env.NewBlockName();
+  }
+}
+
+static bool IsImm12(int imm) {
+  return imm >= -2048 && imm < 2048;
+}
+
+// 调整 sp, 超出 12 位立即数时先把增量放到临时寄存器里
+static void EmitStackAdjust(RISCVEnvironemt &env, int delta) {
+  if (IsImm12(delta)) {
+    env.Emit(RISCVCodeGen::emitAddi(kSp, kSp, delta));
+    return;
+  }
+  Reg temp = env.FindReg();
+  env.Emit(RISCVCodeGen::emitLi(temp.offset, delta));
+  env.Emit(RISCVCodeGen::emitAdd(kSp, kSp, temp.offset));
+}
+
+static void EmitEpilogue(RISCVEnvironemt &env) {
+  if (env.ra >= 0) {
+    env.Emit(RISCVCodeGen::emitLw(kRa, kSp, env.ra));
+  }
+  if (env.frame_size > 0) {
+    EmitStackAdjust(env, env.frame_size);
+  }
+  env.Emit(RISCVCodeGen::emitRet());
+}
+
+// 栈上 slot 的地址: 偏移超出 12 位立即数时先用 lui 算出 sp + 高位, 剩下的低 12 位放在 lw/sw 里.
+// 返回基址寄存器和偏移
+static std::pair<int, int> EmitSlotAddress(RISCVEnvironemt &env, const Reg &r) {
+  if (IsImm12(r.offset)) {
+    return {kSp, r.offset};
+  }
+  int hi = (r.offset + 0x800) >> 12;
+  int lo = r.offset - (hi << 12);
+  Reg temp = env.FindReg();
+  env.Emit(RISCVCodeGen::emitLui(temp.offset, hi));
+  env.Emit(RISCVCodeGen::emitAdd(temp.offset, temp.offset, kSp));
+  return {temp.offset, lo};
+}
+
+// 读栈上的 slot 或全局变量
+static void EmitLoad(RISCVEnvironemt &env, int dest, const Reg &r) {
+  if (r.g != "") {
+    env.Emit(RISCVCodeGen::emitLw(dest, r.g));
+    return;
+  }
+  auto [base, offset] = EmitSlotAddress(env, r);
+  env.Emit(RISCVCodeGen::emitLw(dest, base, offset));
+}
+
+static void EmitStore(RISCVEnvironemt &env, int src, const Reg &r) {
+  if (r.g != "") {
+    // 写全局变量需要一个临时寄存器保存地址
+    Reg temp = env.FindReg();
+    env.Emit(RISCVCodeGen::emitSw(src, r.g, temp.offset));
+    return;
+  }
+  auto [base, offset] = EmitSlotAddress(env, r);
+  env.Emit(RISCVCodeGen::emitSw(src, base, offset));
+}
+
+// 初始值全为 0 的全局变量放进 .bss, 不占可执行文件的空间
+static bool IsZeroInit(koopa_raw_value_t value) {
+  auto init = value->kind.data.global_alloc.init;
+  return init->kind.tag == KOOPA_RVT_ZERO_INIT || IsInteger(init, 0);
+}
+
+// 全局变量所在的节. 程序里从来不被写的放进只读的节
+static std::string GlobalSection(RISCVEnvironemt &env, koopa_raw_value_t value, bool read_only) {
+  bool small = env.small_data && env.cal_size(value->ty->data.pointer.base) <= kSmallDataLimit;
+  if (read_only) {
+    return small ? ".srodata" : ".rodata";
+  }
+  if (IsZeroInit(value)) {
+    return small ? ".sbss" : ".bss";
+  }
+  return small ? ".sdata" : ".data";
+}
+
+// 按节把全局变量分组输出, 每组只切换一次节
+static void EmitGlobals(RISCVEnvironemt &env, const koopa_raw_program_t &program) {
+  std::unordered_set<koopa_raw_value_t> stored;
+  for (size_t f = 0; f < program.funcs.len; f++) {
+    auto func = SliceAt<koopa_raw_function_t>(program.funcs, f);
+    for (size_t b = 0; b < func->bbs.len; b++) {
+      for (auto inst : Insts(SliceAt<koopa_raw_basic_block_t>(func->bbs, b))) {
+        if (inst->kind.tag == KOOPA_RVT_STORE) {
+          stored.insert(inst->kind.data.store.dest);
+        }
+      }
+    }
+  }
+  // 节名和属性. .srodata/.sdata/.sbss 不是汇编器认识的节名, 不写明属性的话不会被分配进内存,
+  // .sbss 也不会是 NOBITS, 里面的 .zero 会占可执行文件的空间
+  static const std::pair<const char *, const char *> sections[] = {
+      {".srodata", "\"a\",@progbits"}, {".rodata", "\"a\",@progbits"},
+      {".sdata", "\"aw\",@progbits"},  {".data", "\"aw\",@progbits"},
+      {".sbss", "\"aw\",@nobits"},     {".bss", "\"aw\",@nobits"},
+  };
+  for (const auto &[section, flags] : sections) {
+    bool started = false;
+    for (size_t i = 0; i < program.values.len; i++) {
+      auto value = SliceAt<koopa_raw_value_t>(program.values, i);
+      if (value->kind.tag != KOOPA_RVT_GLOBAL_ALLOC ||
+          GlobalSection(env, value, !stored.count(value)) != section) {
+        continue;
+      }
+      if (!started) {
+        env.code << "\t.section " << section << "," << flags << "\n";
+        env.code << "\t.align 2\n";
+        started = true;
+      }
+      Visit(env, value);
+    }
+  }
+}
+
 // 访问 raw program
 void Visit(RISCVEnvironemt &env, const koopa_raw_program_t &program) {
   // 执行一些其他的必要操作
   // ...
   // 访问所有全局变量
-  Visit(env, program.values);
+  EmitGlobals(env, program);
   // 访问所有函数
   
   Visit(env, program.funcs);
@@ -268,43 +1022,59 @@ void Visit(RISCVEnvironemt &env, const koopa_raw_function_t &func) {
   if (func->bbs.len == 0) {
     return;
   }
-  env.code << "\t.text\n";
-  env.code << " \t.global " << (func->name + 1) << "\n";
-  env.code << (func->name + 1) << ":\n";
-  assert(env.stack_top == 0);
-  int stack_size = 0;
-  int ra = 0;
-  int call_args = 0;
-  env.ra = -1;
-  env.fp = -1;
+  env.mf = MachineFunction{.name = func->name + 1};
+  env.mf.setup_gp = env.small_data && env.mf.name == "main";
+  env.mf.blocks.push_back(MachineBasicBlock{.label = env.mf.name});
+  // 只被紧随其后的 br 使用的比较直接融合成 beq/bne/blt/bge
+  env.fused_cond.clear();
   for (size_t i = 0; i < func->bbs.len; i++) {
     auto ptr = reinterpret_cast<koopa_raw_basic_block_t>(func->bbs.buffer[i]);
-    for (size_t j = 0; j < ptr->insts.len; j++) {
-      auto inst = reinterpret_cast<koopa_raw_value_t>(ptr->insts.buffer[j]);
-      stack_size += env.cal_size(inst->ty);
-      if (inst->kind.tag == KOOPA_RVT_CALL) {
-        ra = 4;
-        if (inst->kind.data.call.args.len > 7) {
-          call_args += inst->kind.data.call.args.len - 7;
-        }
-      }
+    if (ptr->insts.len < 2) {
+      continue;
+    }
+    auto term = reinterpret_cast<koopa_raw_value_t>(ptr->insts.buffer[ptr->insts.len - 1]);
+    auto prev = reinterpret_cast<koopa_raw_value_t>(ptr->insts.buffer[ptr->insts.len - 2]);
+    if (term->kind.tag == KOOPA_RVT_BRANCH && term->kind.data.branch.cond == prev &&
+        IsCompare(prev) && prev->used_by.len == 1) {
+      env.fused_cond.insert(prev);
+    }
+  }
+  // 比较链的第一个比较融合进了 br 时, x 一直活到 br, 可以在 br 处换成跳转表
+  env.jump_tables.clear();
+  for (const SwitchChain &chain : FindSwitchChains(func)) {
+    if (IsDenseSwitch(chain) && env.fused_cond.count(CaseCompare(chain.head))) {
+      env.jump_tables[chain.head] = chain;
+    }
+  }
+  env.layout = ComputeBlockLayout(env, func);
+  PlanFrame(env, func);
+  if (env.frame_size > 0) {
+    EmitStackAdjust(env, -env.frame_size);
+  }
+  if (env.ra >= 0) {
+    env.Emit(RISCVCodeGen::emitSw(kRa, kSp, env.ra));
+  }
+  for (size_t i = 0; i < std::min<size_t>(func->params.len, 8); i++) {
+    auto param = reinterpret_cast<koopa_raw_value_t>(func->params.buffer[i]);
+    if (env.homes.count(param)) {
+      EmitStore(env, 8 + i, env.homes[param]);
     }
   }
-  stack_size += ra + call_args * 4;
-  if (stack_size != 0) {
-    env.fp = stack_size + 4;
-    env.stack_top = env.fp - 4;
-    Reg r = env.allocStack();
-    env.code << RISCVCodeGen::emitStackAddi(-env.fp);
-    env.code << RISCVCodeGen::emitSw("s0", std::to_string(r.offset) + "(sp)");
+  for (env.cur_block = 0; env.cur_block < env.layout.size(); env.cur_block++) {
+    Visit(env, env.layout[env.cur_block], env.cur_block);
   }
-  if (ra > 0) {
-    Reg r = env.allocStack();
-    env.code << RISCVCodeGen::emitSw("ra", std::to_string(r.offset) + "(sp)");
-    env.ra = r.offset;
+  if (!env.epilogue.empty()) {
+    env.mf.blocks.push_back(MachineBasicBlock{.label = env.epilogue});
+    EmitEpilogue(env);
   }
-  Visit(env, func->bbs);
-  env.stack_top = 0;
+  std::vector<int> scratch;
+  for (int i = 1; i <= kScratchRegs; i++) {
+    scratch.push_back(i);
+  }
+  AllocateVRegs(env.mf, scratch);
+  RunPeephole(env.mf, env.peephole);
+  Schedule(env.mf, *env.cpu);
+  Print(env.code, env.mf);
 }
 
 // 访问基本块
@@ -313,8 +1083,7 @@ void Visit(RISCVEnvironemt &env, const koopa_raw_basic_block_t &bb, size_t i) {
   // ...
   // 访问所有指令
   if (i > 0) {
-    std::string b = env.GetBlockName(bb);
-    env.code << b << ":\n";
+    env.mf.blocks.push_back(MachineBasicBlock{.label = env.GetBlockName(bb)});
   }
   Visit(env, bb->insts);
 }
@@ -336,27 +1105,29 @@ Reg Visit(RISCVEnvironemt &env, const koopa_raw_value_t &value) {
     case KOOPA_RVT_INTEGER: {
       // 访问 integer 指令
       // 有返回值 4
-      Reg r = Visit(env, kind.data.integer);
-      env.value_map[value] = r;
-      return r;
+      // 同一个整数可能被多处使用, 每次都重新生成, 不能复用之前的临时寄存器
+      return Visit(env, kind.data.integer);
     }
     case KOOPA_RVT_BINARY:  {
       // 访问 binary op 
       // 有返回值 4
-      Reg r = Visit(env, kind.data.binary);
+      if (env.fused_cond.count(value)) {
+        // 在 br 中生成
+        return Reg{.offset = -1};
+      }
+      Reg r = Visit(env, kind.data.binary, env.homes[value]);
       env.value_map[value] = r;
       return r;
     }
     case KOOPA_RVT_ALLOC: {
       // alloc有返回值
-      Reg r = {.offset = env.stack_top, .stack = true};
-      env.alloc(value->ty);
+      Reg r = env.homes[value];
       env.value_map[value] = r;
       return r;
     }
     case KOOPA_RVT_LOAD: {
       // load有返回值
-      Reg r = Visit(env, kind.data.load);
+      Reg r = Visit(env, kind.data.load, env.homes[value]);
       env.value_map[value] = r;
       return r;
     }
@@ -374,11 +1145,15 @@ Reg Visit(RISCVEnvironemt &env, const koopa_raw_value_t &value) {
     }
     case KOOPA_RVT_CALL: {
       VisitFunCall(env, kind.data.call.args);
-      env.code << "\tcall " << (kind.data.call.callee->name + 1) << "\n";
+      env.Emit(RISCVCodeGen::emitCall(kind.data.call.callee->name + 1, kind.data.call.args.len));
       int x = env.cal_size(kind.data.call.callee->ty->data.function.ret);
       if (x > 0) {
-        Reg r = env.allocStack();
-        env.code << RISCVCodeGen::emitSw(reg_names[env.retReg], std::to_string(r.offset) + "(sp)");
+        Reg r = env.homes[value];
+        if (r.stack) {
+          EmitStore(env, env.retReg, r);
+        } else if (r.offset != env.retReg) {
+          env.Emit(RISCVCodeGen::emitMv(r.offset, env.retReg));
+        }
         env.value_map[value] = r;
         return r;
       }
@@ -386,10 +1161,13 @@ Reg Visit(RISCVEnvironemt &env, const koopa_raw_value_t &value) {
     }
     case KOOPA_RVT_FUNC_ARG_REF: {
       int idx = kind.data.func_arg_ref.index;
+      if (env.homes.count(value)) {
+        return env.homes[value];
+      }
       if (idx < 8) {
         return Reg{.offset = idx + 8, .stack=false};
       }
-      int offset = env.fp + (idx-8) * 4;
+      int offset = env.frame_size + (idx-8) * 4;
       return Reg{.offset=offset, .stack=true};
     }
     case KOOPA_RVT_GLOBAL_ALLOC: {
@@ -397,8 +1175,8 @@ Reg Visit(RISCVEnvironemt &env, const koopa_raw_value_t &value) {
       std::string name = env.NewGlobalName();
       env.code << "\t.global " << name << "\n";
       env.code << name <<":\n";
-      if (v->kind.tag == KOOPA_RVT_ZERO_INIT) {
-        env.code << "\t.zero 4\n";
+      if (IsZeroInit(value)) {
+        env.code << "\t.zero " << env.cal_size(value->ty->data.pointer.base) << "\n";
       } else if (v->kind.tag == KOOPA_RVT_INTEGER){
         int32_t n = v->kind.data.integer.value;
         env.code << "\t.word " << n << "\n";
@@ -417,30 +1195,83 @@ Reg Visit(RISCVEnvironemt &env, const koopa_raw_value_t &value) {
   }
 }
 
+// 把栈上的值读到一个临时寄存器里, 寄存器里的值原样返回
+static Reg LoadToReg(RISCVEnvironemt &env, Reg r) {
+  if (!r.stack) {
+    return r;
+  }
+  Reg temp = env.FindReg();
+  EmitLoad(env, temp.offset, r);
+  return temp;
+}
+
+// 把一个值放到指定的寄存器里, 整数直接 li, 不经过临时寄存器
+static void MoveToReg(RISCVEnvironemt &env, int dest, const koopa_raw_value_t &value) {
+  if (value->kind.tag == KOOPA_RVT_INTEGER && value->kind.data.integer.value != 0) {
+    env.Emit(RISCVCodeGen::emitLi(dest, value->kind.data.integer.value));
+    return;
+  }
+  Reg r = Visit(env, value);
+  if (r.stack) {
+    EmitLoad(env, dest, r);
+  } else if (r.offset != dest) {
+    env.Emit(RISCVCodeGen::emitMv(dest, r.offset));
+  }
+}
+
+// 传参: 先把第 9 个以后的参数写到栈上. 寄存器之间的拷贝是一组并行拷贝, 目标寄存器不再被
+// 其他拷贝读取时才能写, 成环时先把一个源寄存器挪到临时寄存器里. 常量和栈上的值最后再放
 Reg VisitFunCall(RISCVEnvironemt &env, const koopa_raw_slice_t &slice) {
+  std::vector<std::pair<int, int>> reg_moves;
+  std::vector<std::pair<int, koopa_raw_value_t>> other_moves;
   for (size_t i = 0; i < slice.len; ++i) {
-    auto ptr = slice.buffer[i];
-    Reg r = Visit(env, reinterpret_cast<koopa_raw_value_t>(ptr));
-    if (i < 8) {
-      if (r.stack) {
-        env.code << RISCVCodeGen::emitLw(reg_names[i+8] , r.to_string());
-      } else {
-        env.code << RISCVCodeGen::emitMv(i+8, r.offset);
-        env.SetRegFree(r.offset);
-      }
-    } else {
+    auto ptr = reinterpret_cast<koopa_raw_value_t>(slice.buffer[i]);
+    if (i >= 8) {
       int offset = (i - 8) * 4;
-      Reg t = env.FindReg();
-      if (!r.stack) {
-        env.code << RISCVCodeGen::emitSw(reg_names[r.offset], std::to_string(offset) + "(sp)");
-        env.SetRegFree(r.offset);
-      } else {
-        env.code << RISCVCodeGen::emitLw(reg_names[t.offset], r.to_string()); 
-        env.code << RISCVCodeGen::emitSw(reg_names[t.offset], std::to_string(offset) + "(sp)");
-        env.SetRegFree(t.offset);
+      Reg r = LoadToReg(env, Visit(env, ptr));
+      EmitStore(env, r.offset, Reg{.offset = offset, .stack = true});
+      continue;
+    }
+    int dest = i + 8;
+    if (ptr->kind.tag == KOOPA_RVT_INTEGER) {
+      other_moves.push_back({dest, ptr});
+      continue;
+    }
+    Reg r = Visit(env, ptr);
+    if (r.stack) {
+      other_moves.push_back({dest, ptr});
+    } else if (r.offset != dest) {
+      reg_moves.push_back({dest, r.offset});
+    }
+  }
+  while (!reg_moves.empty()) {
+    bool progress = false;
+    for (size_t k = 0; k < reg_moves.size() && !progress; k++) {
+      int dest = reg_moves[k].first;
+      bool read = false;
+      for (const auto &[d, src] : reg_moves) {
+        read |= src == dest;
+      }
+      if (!read) {
+        env.Emit(RISCVCodeGen::emitMv(dest, reg_moves[k].second));
+        reg_moves.erase(reg_moves.begin() + k);
+        progress = true;
+      }
+    }
+    if (!progress) {
+      int src = reg_moves[0].second;
+      Reg temp = env.FindReg();
+      env.Emit(RISCVCodeGen::emitMv(temp.offset, src));
+      for (auto &[d, s] : reg_moves) {
+        if (s == src) {
+          s = temp.offset;
+        }
       }
     }
   }
+  for (const auto &[dest, value] : other_moves) {
+    MoveToReg(env, dest, value);
+  }
   return Reg{.offset=-1,.stack=false};
 }
 
@@ -449,23 +1280,16 @@ Reg VisitFunCall(RISCVEnvironemt &env, const koopa_raw_slice_t &slice) {
 // ...
 Reg Visit(RISCVEnvironemt &env, const koopa_raw_return_t &ret) {
   if (ret.value) {
-    Reg r = Visit(env, ret.value);
-    if (r.stack) {
-      env.code << RISCVCodeGen::emitLw(reg_names[env.retReg] , r.to_string());
-    } else {
-      env.code << RISCVCodeGen::emitMv(env.retReg, r.offset);
-      env.SetRegFree(r.offset);
-    }
-  }
-  if (env.ra >= 0) {
-    env.code << RISCVCodeGen::emitLw("ra", std::to_string(env.ra) + "(sp)");
+    MoveToReg(env, env.retReg, ret.value);
   }
-  if (env.fp >= 0) {
-    env.code << RISCVCodeGen::emitLw("s0", std::to_string(env.fp - 4) + "(sp)");
-    env.code << RISCVCodeGen::emitStackAddi(env.fp);
+  if (!env.epilogue.empty()) {
+    // 最后一个块直接 fallthrough 到 epilogue
+    if (env.NextBlock() != nullptr) {
+      env.Emit(RISCVCodeGen::emitJal(env.epilogue));
+    }
+    return Reg {-1};
   }
-  env.code << RISCVCodeGen::emitRet(); 
-  env.code << "\n";
+  EmitEpilogue(env);
   return Reg {-1};
 }
 
@@ -474,147 +1298,523 @@ Reg Visit(RISCVEnvironemt &env, const koopa_raw_integer_t &val) {
     return Reg{env.zeroReg};
   }
   Reg reg = env.FindReg();
-  env.code << RISCVCodeGen::emitLi(reg.offset, val.value);
+  env.Emit(RISCVCodeGen::emitLi(reg.offset, val.value));
   return reg;
 }
 
-Reg Visit(RISCVEnvironemt &env, const koopa_raw_binary_t &val) {
-  Reg lhs = Visit(env, val.lhs);
-  Reg rhs = Visit(env, val.rhs);
-  if (lhs.stack) {
-    Reg temp = env.FindReg();
-    env.code << RISCVCodeGen::emitLw(reg_names[temp.offset], lhs.to_string());
-    lhs = temp;
+// 常数 c 的非相邻形式 (NAF): c = sum(sign * 2^pos), 非零位互不相邻, 按 pos 从高到低.
+// 运算按 2^32 取模, 第 32 位及以上的位可以直接丢掉
+static std::vector<std::pair<int, int>> NafDigits(uint32_t c) {
+  std::vector<std::pair<int, int>> digits;
+  int64_t n = c;
+  for (int pos = 0; n != 0; pos++, n >>= 1) {
+    if (n & 1) {
+      int sign = (n & 3) == 1 ? 1 : -1;
+      n -= sign;
+      if (pos < 32) {
+        digits.push_back({pos, sign});
+      }
+    }
   }
-  if (rhs.stack) {
-    Reg temp = env.FindReg();
-    env.code << RISCVCodeGen::emitLw(reg_names[temp.offset], rhs.to_string());
-    rhs = temp;
+  std::reverse(digits.begin(), digits.end());
+  return digits;
+}
+
+// 乘以常数的移位加减序列: 从最高位开始 acc = (acc << 间隔) ± x, 最后左移末尾的 0.
+// 中间结果放在虚拟寄存器里, 只有最后一条写 rd (rd 可能和 x 是同一个寄存器)
+static std::vector<MachineInstr> MulByConstantSequence(RISCVEnvironemt &env, int rd, int x,
+                                                       uint32_t c) {
+  std::vector<MachineInstr> seq;
+  std::vector<std::pair<int, int>> digits = NafDigits(c);
+  if (digits.empty()) {
+    seq.push_back(RISCVCodeGen::emitMv(rd, env.zeroReg));
+    return seq;
+  }
+  int acc = x;
+  auto emit = [&](MachineInstr inst) {
+    inst.rd = env.FindReg().offset;
+    acc = inst.rd;
+    seq.push_back(inst);
+  };
+  if (digits[0].second < 0) {
+    emit(RISCVCodeGen::emitSub(-1, env.zeroReg, acc));
+  }
+  for (size_t k = 1; k < digits.size(); k++) {
+    emit(RISCVCodeGen::emitSlli(-1, acc, digits[k - 1].first - digits[k].first));
+    if (digits[k].second > 0) {
+      emit(RISCVCodeGen::emitAdd(-1, acc, x));
+    } else {
+      emit(RISCVCodeGen::emitSub(-1, acc, x));
+    }
+  }
+  if (digits.back().first > 0) {
+    emit(RISCVCodeGen::emitSlli(-1, acc, digits.back().first));
+  }
+  if (seq.empty()) {
+    seq.push_back(RISCVCodeGen::emitMv(rd, x));
+  }
+  seq.back().rd = rd;
+  return seq;
+}
+
+// 一个操作数是常数的乘法: 移位加减序列的指令数少于 li + mul 的延迟时就不用 mul
+static bool EmitMulByConstant(RISCVEnvironemt &env, const koopa_raw_binary_t &val, int rd) {
+  bool lhs_const = val.lhs->kind.tag == KOOPA_RVT_INTEGER;
+  bool rhs_const = val.rhs->kind.tag == KOOPA_RVT_INTEGER;
+  if (!lhs_const && !rhs_const) {
+    return false;
   }
-  Reg ret = env.FindReg();
+  int32_t c = rhs_const ? val.rhs->kind.data.integer.value : val.lhs->kind.data.integer.value;
+  koopa_raw_value_t other = rhs_const ? val.lhs : val.rhs;
+  // 先用一个占位的寄存器估算长度
+  size_t length = MulByConstantSequence(env, 0, 0, c).size();
+  int mul_cost = (IsImm12(c) ? 1 : 2) + env.cpu->mul;
+  if ((int)length >= mul_cost) {
+    return false;
+  }
+  Reg x = LoadToReg(env, Visit(env, other));
+  for (const auto &inst : MulByConstantSequence(env, rd, x.offset, c)) {
+    env.Emit(inst);
+  }
+  return true;
+}
+
+// 有符号除法的魔数 (Hacker's Delight 10-1): x / d = (mulh(x, M) [± x]) >> s, 再加上结果的符号位.
+// d 不能是 0, 1, -1
+static std::pair<int32_t, int> DivisionMagic(int32_t d) {
+  const uint32_t two31 = 0x80000000u;
+  uint32_t ad = d < 0 ? 0u - (uint32_t)d : d;
+  uint32_t t = two31 + ((uint32_t)d >> 31);
+  uint32_t anc = t - 1 - t % ad;
+  int p = 31;
+  uint32_t q1 = two31 / anc, r1 = two31 - q1 * anc;
+  uint32_t q2 = two31 / ad, r2 = two31 - q2 * ad;
+  uint32_t delta;
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad) {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+  uint32_t magic = q2 + 1;
+  if (d < 0) {
+    magic = 0u - magic;
+  }
+  return {(int32_t)magic, p - 32};
+}
+
+// 除以常数 d (向零取整), 商写到 rd. 中间结果都在虚拟寄存器里
+static void EmitDivideByConstant(RISCVEnvironemt &env, int rd, int x, int32_t d) {
+  auto temp = [&]() { return env.FindReg().offset; };
+  uint32_t ad = d < 0 ? 0u - (uint32_t)d : d;
+  if (ad == 1) {
+    env.Emit(d > 0 ? RISCVCodeGen::emitMv(rd, x) : RISCVCodeGen::emitSub(rd, env.zeroReg, x));
+    return;
+  }
+  int q = temp();
+  if ((ad & (ad - 1)) == 0) {
+    // 2^k: 负数先加上 2^k - 1 再算术右移, 这样是向零取整
+    int k = __builtin_ctz(ad);
+    int bias = temp(), sum = temp();
+    if (k == 1) {
+      env.Emit(RISCVCodeGen::emitSrli(bias, x, 31));
+    } else {
+      int sign = temp();
+      env.Emit(RISCVCodeGen::emitSrai(sign, x, 31));
+      env.Emit(RISCVCodeGen::emitSrli(bias, sign, 32 - k));
+    }
+    env.Emit(RISCVCodeGen::emitAdd(sum, x, bias));
+    env.Emit(RISCVCodeGen::emitSrai(d > 0 ? rd : q, sum, k));
+    if (d < 0) {
+      env.Emit(RISCVCodeGen::emitSub(rd, env.zeroReg, q));
+    }
+    return;
+  }
+  auto [magic, shift] = DivisionMagic(d);
+  int m = temp();
+  env.Emit(RISCVCodeGen::emitLi(m, magic));
+  env.Emit(RISCVCodeGen::emitMulh(q, x, m));
+  if (d > 0 && magic < 0) {
+    int sum = temp();
+    env.Emit(RISCVCodeGen::emitAdd(sum, q, x));
+    q = sum;
+  } else if (d < 0 && magic > 0) {
+    int diff = temp();
+    env.Emit(RISCVCodeGen::emitSub(diff, q, x));
+    q = diff;
+  }
+  if (shift > 0) {
+    int shifted = temp();
+    env.Emit(RISCVCodeGen::emitSrai(shifted, q, shift));
+    q = shifted;
+  }
+  int sign = temp();
+  env.Emit(RISCVCodeGen::emitSrli(sign, q, 31));
+  env.Emit(RISCVCodeGen::emitAdd(rd, q, sign));
+}
+
+// 除数是常数的 div / rem. 不用几十个周期的 div/rem 指令:
+// 2^k 用移位, 其他常数乘以魔数取高位; 余数是 x - (x / d) * d, 乘法同样按常数优化
+static bool EmitDivByConstant(RISCVEnvironemt &env, const koopa_raw_binary_t &val, int rd) {
+  if (val.rhs->kind.tag != KOOPA_RVT_INTEGER || val.rhs->kind.data.integer.value == 0) {
+    return false;
+  }
+  int32_t d = val.rhs->kind.data.integer.value;
+  uint32_t ad = d < 0 ? 0u - (uint32_t)d : d;
+  Reg x = LoadToReg(env, Visit(env, val.lhs));
+  if (val.op == KOOPA_RBO_DIV) {
+    EmitDivideByConstant(env, rd, x.offset, d);
+    return true;
+  }
+  if (ad == 1) {
+    env.Emit(RISCVCodeGen::emitMv(rd, env.zeroReg));
+    return true;
+  }
+  int multiple = env.FindReg().offset;
+  if ((ad & (ad - 1)) == 0) {
+    // x % 2^k = x - ((x + bias) & -2^k), 和除数的符号无关
+    int k = __builtin_ctz(ad);
+    int bias = env.FindReg().offset, sum = env.FindReg().offset;
+    if (k == 1) {
+      env.Emit(RISCVCodeGen::emitSrli(bias, x.offset, 31));
+    } else {
+      int sign = env.FindReg().offset;
+      env.Emit(RISCVCodeGen::emitSrai(sign, x.offset, 31));
+      env.Emit(RISCVCodeGen::emitSrli(bias, sign, 32 - k));
+    }
+    env.Emit(RISCVCodeGen::emitAdd(sum, x.offset, bias));
+    int32_t mask = (int32_t)(0u - ad);
+    if (IsImm12(mask)) {
+      env.Emit(RISCVCodeGen::emitAndi(multiple, sum, mask));
+    } else {
+      int m = env.FindReg().offset;
+      env.Emit(RISCVCodeGen::emitLi(m, mask));
+      env.Emit(RISCVCodeGen::emitAnd(multiple, sum, m));
+    }
+  } else {
+    int q = env.FindReg().offset;
+    EmitDivideByConstant(env, q, x.offset, d);
+    size_t length = MulByConstantSequence(env, 0, 0, d).size();
+    if ((int)length < (IsImm12(d) ? 1 : 2) + env.cpu->mul) {
+      for (const auto &inst : MulByConstantSequence(env, multiple, q, d)) {
+        env.Emit(inst);
+      }
+    } else {
+      int m = env.FindReg().offset;
+      env.Emit(RISCVCodeGen::emitLi(m, d));
+      env.Emit(RISCVCodeGen::emitMul(multiple, q, m));
+    }
+  }
+  env.Emit(RISCVCodeGen::emitSub(rd, x.offset, multiple));
+  return true;
+}
+
+// 右操作数是 12 位立即数时用 I 型指令, 省掉一条 li. 常量已经被 IR 上的化简放到了右边
+static bool EmitBinaryImm(RISCVEnvironemt &env, const koopa_raw_binary_t &val, int rd) {
+  if (val.rhs->kind.tag != KOOPA_RVT_INTEGER || val.lhs->kind.tag == KOOPA_RVT_INTEGER) {
+    return false;
+  }
+  int32_t c = val.rhs->kind.data.integer.value;
+  // x > c 即 !(x < c + 1), x <= c 即 x < c + 1
+  bool plus_one = (val.op == KOOPA_RBO_GT || val.op == KOOPA_RBO_LE) && c != INT32_MAX;
+  switch (val.op) {
+    case KOOPA_RBO_ADD:
+    case KOOPA_RBO_AND:
+    case KOOPA_RBO_OR:
+    case KOOPA_RBO_XOR:
+    case KOOPA_RBO_LT:
+    case KOOPA_RBO_GE:
+    case KOOPA_RBO_EQ:
+    case KOOPA_RBO_NOT_EQ:
+      if (!IsImm12(c)) {
+        return false;
+      }
+      break;
+    case KOOPA_RBO_SUB:
+      if (c == INT32_MIN || !IsImm12(-c)) {
+        return false;
+      }
+      break;
+    case KOOPA_RBO_GT:
+    case KOOPA_RBO_LE:
+      if (!plus_one || !IsImm12(c + 1)) {
+        return false;
+      }
+      break;
+    case KOOPA_RBO_SHL:
+    case KOOPA_RBO_SHR:
+    case KOOPA_RBO_SAR:
+      break;
+    default:
+      return false;
+  }
+  int x = LoadToReg(env, Visit(env, val.lhs)).offset;
   switch (val.op) {
+    case KOOPA_RBO_ADD:
+      env.Emit(RISCVCodeGen::emitAddi(rd, x, c));
+      break;
+    case KOOPA_RBO_SUB:
+      env.Emit(RISCVCodeGen::emitAddi(rd, x, -c));
+      break;
+    case KOOPA_RBO_AND:
+      env.Emit(RISCVCodeGen::emitAndi(rd, x, c));
+      break;
+    case KOOPA_RBO_OR:
+      env.Emit(RISCVCodeGen::emitOri(rd, x, c));
+      break;
+    case KOOPA_RBO_XOR:
+      env.Emit(RISCVCodeGen::emitXori(rd, x, c));
+      break;
+    case KOOPA_RBO_LT:
+    case KOOPA_RBO_LE:
+      env.Emit(RISCVCodeGen::emitSlti(rd, x, plus_one ? c + 1 : c));
+      break;
+    case KOOPA_RBO_GE:
+    case KOOPA_RBO_GT:
+      env.Emit(RISCVCodeGen::emitSlti(rd, x, plus_one ? c + 1 : c));
+      env.Emit(RISCVCodeGen::emitSeqz(rd, rd));
+      break;
     case KOOPA_RBO_EQ:
-      env.code << RISCVCodeGen::emitXor(ret.offset, lhs.offset, rhs.offset);
-      env.code << RISCVCodeGen::emitSeqz(ret.offset, ret.offset);
+    case KOOPA_RBO_NOT_EQ: {
+      int diff = x;
+      if (c != 0) {
+        diff = env.FindReg().offset;
+        env.Emit(RISCVCodeGen::emitXori(diff, x, c));
+      }
+      if (val.op == KOOPA_RBO_EQ) {
+        env.Emit(RISCVCodeGen::emitSeqz(rd, diff));
+      } else {
+        env.Emit(RISCVCodeGen::emitSnez(rd, diff));
+      }
+      break;
+    }
+    case KOOPA_RBO_SHL:
+      env.Emit(RISCVCodeGen::emitSlli(rd, x, c & 31));
+      break;
+    case KOOPA_RBO_SHR:
+      env.Emit(RISCVCodeGen::emitSrli(rd, x, c & 31));
+      break;
+    case KOOPA_RBO_SAR:
+      env.Emit(RISCVCodeGen::emitSrai(rd, x, c & 31));
+      break;
+    default:
+      assert(false);
+  }
+  return true;
+}
+
+Reg Visit(RISCVEnvironemt &env, const koopa_raw_binary_t &val, Reg dest) {
+  Reg ret = dest.stack ? env.FindReg() : dest;
+  bool is_div = val.op == KOOPA_RBO_DIV || val.op == KOOPA_RBO_MOD;
+  if ((val.op == KOOPA_RBO_MUL && EmitMulByConstant(env, val, ret.offset)) ||
+      (is_div && EmitDivByConstant(env, val, ret.offset)) ||
+      EmitBinaryImm(env, val, ret.offset)) {
+    if (dest.stack) {
+      EmitStore(env, ret.offset, dest);
+    }
+    return dest;
+  }
+  Reg lhs = LoadToReg(env, Visit(env, val.lhs));
+  Reg rhs = LoadToReg(env, Visit(env, val.rhs));
+  switch (val.op) {
+    case KOOPA_RBO_EQ:
+      env.Emit(RISCVCodeGen::emitXor(ret.offset, lhs.offset, rhs.offset));
+      env.Emit(RISCVCodeGen::emitSeqz(ret.offset, ret.offset));
       break;
     case KOOPA_RBO_NOT_EQ:
-      env.code << RISCVCodeGen::emitXor(ret.offset, lhs.offset, rhs.offset);
-      env.code << RISCVCodeGen::emitSnez(ret.offset, ret.offset);
+      env.Emit(RISCVCodeGen::emitXor(ret.offset, lhs.offset, rhs.offset));
+      env.Emit(RISCVCodeGen::emitSnez(ret.offset, ret.offset));
       break;
     case KOOPA_RBO_GT:
-      env.code << RISCVCodeGen::emitSgt(ret.offset, lhs.offset, rhs.offset);
+      env.Emit(RISCVCodeGen::emitSgt(ret.offset, lhs.offset, rhs.offset));
       break;
     case KOOPA_RBO_LT:
-      env.code << RISCVCodeGen::emitSlt(ret.offset, lhs.offset, rhs.offset);
+      env.Emit(RISCVCodeGen::emitSlt(ret.offset, lhs.offset, rhs.offset));
       break;
     case KOOPA_RBO_GE:
-      env.code << RISCVCodeGen::emitSub(ret.offset, lhs.offset, rhs.offset);
-      env.code << RISCVCodeGen::emitSlt(ret.offset, env.zeroReg, ret.offset);
+      env.Emit(RISCVCodeGen::emitSlt(ret.offset, lhs.offset, rhs.offset));
+      env.Emit(RISCVCodeGen::emitSeqz(ret.offset, ret.offset));
       break;
     case KOOPA_RBO_LE:
-      env.code << RISCVCodeGen::emitSub(ret.offset, lhs.offset, rhs.offset);
-      env.code << RISCVCodeGen::emitSgt(ret.offset, env.zeroReg, ret.offset);
+      env.Emit(RISCVCodeGen::emitSgt(ret.offset, lhs.offset, rhs.offset));
+      env.Emit(RISCVCodeGen::emitSeqz(ret.offset, ret.offset));
       break;
     case KOOPA_RBO_ADD:
-      env.code << RISCVCodeGen::emitAdd(ret.offset, lhs.offset, rhs.offset);
+      env.Emit(RISCVCodeGen::emitAdd(ret.offset, lhs.offset, rhs.offset));
       break;
     case KOOPA_RBO_SUB:
-      env.code << RISCVCodeGen::emitSub(ret.offset, lhs.offset, rhs.offset);
+      env.Emit(RISCVCodeGen::emitSub(ret.offset, lhs.offset, rhs.offset));
       break;
     case KOOPA_RBO_MUL:
-      env.code << RISCVCodeGen::emitMul(ret.offset, lhs.offset, rhs.offset);
+      env.Emit(RISCVCodeGen::emitMul(ret.offset, lhs.offset, rhs.offset));
       break;
     case KOOPA_RBO_DIV:
-      env.code << RISCVCodeGen::emitDiv(ret.offset, lhs.offset, rhs.offset);
+      env.Emit(RISCVCodeGen::emitDiv(ret.offset, lhs.offset, rhs.offset));
       break;
     case KOOPA_RBO_MOD:
-      env.code << RISCVCodeGen::emitRem(ret.offset, lhs.offset, rhs.offset);
+      env.Emit(RISCVCodeGen::emitRem(ret.offset, lhs.offset, rhs.offset));
       break;
     case KOOPA_RBO_AND: 
-      env.code << RISCVCodeGen::emitAnd(ret.offset, lhs.offset, rhs.offset);
+      env.Emit(RISCVCodeGen::emitAnd(ret.offset, lhs.offset, rhs.offset));
       break;
     case KOOPA_RBO_OR:
-      env.code << RISCVCodeGen::emitOr(ret.offset, lhs.offset, rhs.offset);
+      env.Emit(RISCVCodeGen::emitOr(ret.offset, lhs.offset, rhs.offset));
       break;
     case KOOPA_RBO_XOR:
-      env.code << RISCVCodeGen::emitXor(ret.offset, lhs.offset, rhs.offset);
+      env.Emit(RISCVCodeGen::emitXor(ret.offset, lhs.offset, rhs.offset));
       break;
     case KOOPA_RBO_SHL:
-      env.code << RISCVCodeGen::emitSll(ret.offset, lhs.offset, rhs.offset);
+      env.Emit(RISCVCodeGen::emitSll(ret.offset, lhs.offset, rhs.offset));
       break;
     case KOOPA_RBO_SHR:
-      env.code << RISCVCodeGen::emitSrl(ret.offset, lhs.offset, rhs.offset);
+      env.Emit(RISCVCodeGen::emitSrl(ret.offset, lhs.offset, rhs.offset));
       break;
     case KOOPA_RBO_SAR:  
-      env.code << RISCVCodeGen::emitSra(ret.offset, lhs.offset, rhs.offset);
+      env.Emit(RISCVCodeGen::emitSra(ret.offset, lhs.offset, rhs.offset));
       break;
   }
-  env.SetRegFree(lhs.offset);
-  env.SetRegFree(rhs.offset);
-  Reg r = env.allocStack();
-  env.code << RISCVCodeGen::emitSw(reg_names[ret.offset], std::to_string(r.offset) + "(sp)");
-  env.SetRegFree(ret.offset);
-  return r;
+  if (dest.stack) {
+    EmitStore(env, ret.offset, dest);
+  }
+  return dest;
 }
 
-Reg Visit(RISCVEnvironemt &env, const koopa_raw_load_t &val) {
+Reg Visit(RISCVEnvironemt &env, const koopa_raw_load_t &val, Reg dest) {
   Reg r = Visit(env, val.src);
-  // Reg dest = env.FindReg();
-  // if (dest.offset == -1) {
-  //   dest = env.allocStack();
-  // }
-  Reg dest = env.allocStack();
-  if (!r.stack && !dest.stack) {
-    env.code << RISCVCodeGen::emitMv(dest.offset, r.offset);
-  } else if (!r.stack && dest.stack) {
-    env.code << RISCVCodeGen::emitSw(reg_names[r.offset], dest.to_string());
-  } else if (r.stack && !dest.stack) {
-    env.code << RISCVCodeGen::emitLw(reg_names[dest.offset], r.to_string());
-  } else {
-    Reg temp = env.FindReg();
-    env.code << RISCVCodeGen::emitLw(reg_names[temp.offset], r.to_string());
-    env.code << RISCVCodeGen::emitSw(reg_names[temp.offset], dest.to_string());
-    env.SetRegFree(temp.offset);
+  if (!dest.stack) {
+    if (r.stack) {
+      EmitLoad(env, dest.offset, r);
+    } else if (r.offset != dest.offset) {
+      env.Emit(RISCVCodeGen::emitMv(dest.offset, r.offset));
+    }
+    return dest;
   }
+  Reg temp = LoadToReg(env, r);
+  EmitStore(env, temp.offset, dest);
   return dest;
 }
 
 Reg Visit(RISCVEnvironemt &env, const koopa_raw_store_t &val) {
   Reg dest = Visit(env, val.dest);
-  Reg value = Visit(env, val.value);
-  if (value.stack) {
-    Reg temp = env.FindReg();
-    env.code << RISCVCodeGen::emitLw(reg_names[temp.offset], value.to_string());
-    env.code << RISCVCodeGen::emitSw(reg_names[temp.offset], dest.to_string());
-    env.SetRegFree(temp.offset);
-  } else {
-    env.code << RISCVCodeGen::emitSw(reg_names[value.offset], dest.to_string());
-    env.SetRegFree(value.offset);
+  if (!dest.stack) {
+    MoveToReg(env, dest.offset, val.value);
+    return dest;
   }
+  Reg value = LoadToReg(env, Visit(env, val.value));
+  EmitStore(env, value.offset, dest);
   return value;
 }
 
+// 融合的比较 + 条件跳转, 条件成立时跳到 target
+static void EmitCompareBranch(RISCVEnvironemt &env, koopa_raw_binary_op_t op, int lhs, int rhs,
+                              std::string target) {
+  switch (op) {
+    case KOOPA_RBO_EQ:
+      env.Emit(RISCVCodeGen::emitBeq(lhs, rhs, target));
+      break;
+    case KOOPA_RBO_NOT_EQ:
+      env.Emit(RISCVCodeGen::emitBne(lhs, rhs, target));
+      break;
+    case KOOPA_RBO_LT:
+      env.Emit(RISCVCodeGen::emitBlt(lhs, rhs, target));
+      break;
+    case KOOPA_RBO_GE:
+      env.Emit(RISCVCodeGen::emitBge(lhs, rhs, target));
+      break;
+    case KOOPA_RBO_GT:
+      env.Emit(RISCVCodeGen::emitBlt(rhs, lhs, target));
+      break;
+    case KOOPA_RBO_LE:
+      env.Emit(RISCVCodeGen::emitBge(rhs, lhs, target));
+      break;
+    default:
+      assert(false);
+  }
+}
+
+// 跳转表: x - low 按无符号数和表的项数比较, 越界 (包括小于 low) 时跳到 default,
+// 否则从表里取出目标的地址 jr 过去. 范围内没有出现的常量对应的项也是 default
+static void EmitJumpTable(RISCVEnvironemt &env, const SwitchChain &chain) {
+  int32_t low = chain.Low();
+  int size = (int)((int64_t)chain.High() - low + 1);
+  std::string default_name = env.GetBlockName(chain.default_bb);
+  JumpTable table{.name = env.NewJumpTableName(),
+                  .targets = std::vector<std::string>(size, default_name)};
+  for (const auto &[k, target] : chain.cases) {
+    table.targets[k - low] = env.GetBlockName(target);
+  }
+  Reg x = LoadToReg(env, Visit(env, chain.value));
+  int index = x.offset;
+  if (low != 0) {
+    index = env.FindReg().offset;
+    if (low > -2048 && low <= 2048) {
+      env.Emit(RISCVCodeGen::emitAddi(index, x.offset, -low));
+    } else {
+      Reg temp = env.FindReg();
+      env.Emit(RISCVCodeGen::emitLi(temp.offset, low));
+      env.Emit(RISCVCodeGen::emitSub(index, x.offset, temp.offset));
+    }
+  }
+  Reg bound = env.FindReg();
+  env.Emit(RISCVCodeGen::emitLi(bound.offset, size));
+  env.Emit(RISCVCodeGen::emitBgeu(index, bound.offset, default_name));
+  Reg offset = env.FindReg(), base = env.FindReg(), addr = env.FindReg(), dest = env.FindReg();
+  env.Emit(RISCVCodeGen::emitSlli(offset.offset, index, 2));
+  env.Emit(RISCVCodeGen::emitLa(base.offset, table.name));
+  env.Emit(RISCVCodeGen::emitAdd(addr.offset, base.offset, offset.offset));
+  env.Emit(RISCVCodeGen::emitLw(dest.offset, addr.offset, 0));
+  env.Emit(RISCVCodeGen::emitJr(dest.offset, table.name));
+  env.mf.jump_tables.push_back(table);
+}
+
+// 下一个块是 false 分支时只生成条件跳转; 是 true 分支时条件取反, 跳到 false 分支;
+// 都不是时才需要额外的 j
 Reg Visit(RISCVEnvironemt &env, const koopa_raw_branch_t &val) {
-  Reg reg = Visit(env, val.cond);
+  auto table = env.jump_tables.find(env.layout[env.cur_block]);
+  if (table != env.jump_tables.end()) {
+    EmitJumpTable(env, table->second);
+    return Reg{.offset=-1};
+  }
   std::string true_branch_name = env.GetBlockName(val.true_bb);
   std::string false_branch_name = env.GetBlockName(val.false_bb);
-  if (reg.stack) {
-    Reg temp = env.FindReg();
-    env.code << RISCVCodeGen::emitLw(reg_names[temp.offset], reg.to_string());
-    env.code << RISCVCodeGen::emitBnez(temp.offset, true_branch_name);
-    env.code << RISCVCodeGen::emitJal(false_branch_name);
-    env.SetRegFree(temp.offset);
+  koopa_raw_basic_block_t next = env.NextBlock();
+  bool invert = next == val.true_bb;
+  std::string target = invert ? false_branch_name : true_branch_name;
+  if (env.fused_cond.count(val.cond)) {
+    const auto &cmp = val.cond->kind.data.binary;
+    Reg lhs = LoadToReg(env, Visit(env, cmp.lhs));
+    Reg rhs = LoadToReg(env, Visit(env, cmp.rhs));
+    koopa_raw_binary_op_t op = invert ? InvertCompare(cmp.op) : cmp.op;
+    EmitCompareBranch(env, op, lhs.offset, rhs.offset, target);
   } else {
-    env.code << RISCVCodeGen::emitBnez(reg.offset, true_branch_name);
-    env.code << RISCVCodeGen::emitJal(false_branch_name);
-    env.SetRegFree(reg.offset);
+    Reg reg = LoadToReg(env, Visit(env, val.cond));
+    if (invert) {
+      env.Emit(RISCVCodeGen::emitBeqz(reg.offset, target));
+    } else {
+      env.Emit(RISCVCodeGen::emitBnez(reg.offset, target));
+    }
+  }
+  if (next != val.true_bb && next != val.false_bb) {
+    env.Emit(RISCVCodeGen::emitJal(false_branch_name));
   }
   return Reg{.offset=-1};
 }
 
 Reg Visit(RISCVEnvironemt &env, const koopa_raw_jump_t &val) {
+  if (env.NextBlock() == val.target) {
+    return Reg{.offset=-1};
+  }
   std::string true_branch_name = env.GetBlockName(val.target);
-  env.code << RISCVCodeGen::emitJal(true_branch_name);
+  env.Emit(RISCVCodeGen::emitJal(true_branch_name));
   return Reg{.offset=-1};
 }
-
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "MIR.hpp"
+
+// 顺序单发射流水线上的基本块内 list scheduling. 在寄存器分配之后运行, 依赖关系按物理寄存器
+// (写后读 / 读后写 / 写后写) 和内存 (栈上 slot 按偏移, 全局变量按符号区分) 建图,
+// 每次从就绪的指令里选关键路径最长的, 尽量把 load 和 mul/div 的结果和它的使用隔开
+
+// 每种 CPU 上指令结果可用所需的周期数 (近似值), 1 表示下一条指令就能用
+struct CpuModel {
+  const char *name;
+  int alu;
+  int load;
+  int mul;
+  int div;
+  // 除法器不流水, 除法执行时后面的指令都要等着, 这时调度也藏不住它的延迟
+  bool div_blocks;
+  // 分支预测失败的代价, if-conversion 用它来估计数据相关的分支的开销
+  int branch_miss;
+};
+
+static const CpuModel cpu_models[] = {
+    // load-use 停顿 1 个周期, 乘法 2 个周期
+    {"generic", 1, 2, 3, 34, true, 6},
+    {"rocket", 1, 3, 4, 33, false, 3},
+    {"sifive-e31", 1, 3, 3, 34, true, 3},
+};
+
+// 没有这个名字的 CPU 时返回 nullptr
+static const CpuModel *FindCpuModel(const std::string &name) {
+  for (const auto &cpu : cpu_models) {
+    if (name == cpu.name) {
+      return &cpu;
+    }
+  }
+  return nullptr;
+}
+
+static int Latency(const CpuModel &cpu, const MachineInstr &inst) {
+  switch (inst.op) {
+    case MOp::kLw:
+      return cpu.load;
+    case MOp::kMul:
+    case MOp::kMulh:
+      return cpu.mul;
+    case MOp::kDiv:
+    case MOp::kRem:
+      return cpu.div_blocks ? cpu.alu : cpu.div;
+    default:
+      return cpu.alu;
+  }
+}
+
+// 两条访存指令可能访问同一个地址吗. 栈上 slot 只有基址都是 sp 时才能按偏移区分
+static bool MayAlias(const MachineInstr &a, const MachineInstr &b) {
+  if (!a.sym.empty() || !b.sym.empty()) {
+    return a.sym == b.sym;
+  }
+  if (a.rs1 == kSp && b.rs1 == kSp) {
+    return a.imm == b.imm;
+  }
+  return true;
+}
+
+// 对 [begin, end) 里的指令重新排序, 这段里没有 call 和跳转
+static void ScheduleRegion(std::vector<MachineInstr> &insts, size_t begin, size_t end,
+                           const CpuModel &cpu) {
+  size_t n = end - begin;
+  if (n < 2) {
+    return;
+  }
+  struct Edge {
+    size_t to;
+    int latency;
+  };
+  std::vector<std::vector<Edge>> succs(n);
+  std::vector<int> preds(n, 0);
+  auto add_edge = [&](size_t from, size_t to, int latency) {
+    succs[from].push_back(Edge{to, latency});
+    preds[to]++;
+  };
+  for (size_t j = 0; j < n; j++) {
+    const MachineInstr &b = insts[begin + j];
+    std::vector<int> b_defs = b.Defs(), b_uses = b.Uses();
+    bool b_mem = b.op == MOp::kLw || b.op == MOp::kSw;
+    for (size_t i = 0; i < j; i++) {
+      const MachineInstr &a = insts[begin + i];
+      std::vector<int> a_defs = a.Defs(), a_uses = a.Uses();
+      int latency = -1;
+      for (int reg : a_defs) {
+        if (reg == 0) {
+          continue;
+        }
+        if (std::find(b_uses.begin(), b_uses.end(), reg) != b_uses.end()) {
+          latency = std::max(latency, Latency(cpu, a));
+        }
+        if (std::find(b_defs.begin(), b_defs.end(), reg) != b_defs.end()) {
+          latency = std::max(latency, 1);
+        }
+      }
+      for (int reg : a_uses) {
+        if (std::find(b_defs.begin(), b_defs.end(), reg) != b_defs.end()) {
+          latency = std::max(latency, 0);
+        }
+      }
+      bool a_mem = a.op == MOp::kLw || a.op == MOp::kSw;
+      if (a_mem && b_mem && (a.op == MOp::kSw || b.op == MOp::kSw) && MayAlias(a, b)) {
+        latency = std::max(latency, a.op == MOp::kSw ? 1 : 0);
+      }
+      if (latency >= 0) {
+        add_edge(i, j, latency);
+      }
+    }
+  }
+  // 优先级: 到区域末尾的最长路径
+  std::vector<int> height(n, 0);
+  for (size_t i = n; i-- > 0;) {
+    height[i] = Latency(cpu, insts[begin + i]);
+    for (const auto &e : succs[i]) {
+      height[i] = std::max(height[i], e.latency + height[e.to]);
+    }
+  }
+  std::vector<int> earliest(n, 0);
+  std::vector<bool> done(n, false);
+  std::vector<MachineInstr> order;
+  int cycle = 0;
+  for (size_t k = 0; k < n; k++) {
+    // 已经可以发射的指令里选关键路径最长的, 没有的话就选最早能发射的
+    size_t best = n;
+    for (size_t i = 0; i < n; i++) {
+      if (done[i] || preds[i] > 0) {
+        continue;
+      }
+      if (best == n) {
+        best = i;
+        continue;
+      }
+      bool ready = earliest[i] <= cycle, best_ready = earliest[best] <= cycle;
+      if (ready != best_ready) {
+        if (ready) {
+          best = i;
+        }
+      } else if (!ready && earliest[i] != earliest[best]) {
+        if (earliest[i] < earliest[best]) {
+          best = i;
+        }
+      } else if (height[i] > height[best]) {
+        best = i;
+      }
+    }
+    cycle = std::max(cycle, earliest[best]);
+    done[best] = true;
+    order.push_back(insts[begin + best]);
+    for (const auto &e : succs[best]) {
+      preds[e.to]--;
+      earliest[e.to] = std::max(earliest[e.to], cycle + e.latency);
+    }
+    cycle++;
+  }
+  std::copy(order.begin(), order.end(), insts.begin() + begin);
+}
+
+static void Schedule(MachineFunction &mf, const CpuModel &cpu) {
+  for (auto &mbb : mf.blocks) {
+    auto &insts = mbb.insts;
+    // 末尾的跳转保持不动, call 和块中间的条件跳转 (跳转表的范围检查) 把块分成几段分别调度
+    size_t end = insts.size();
+    while (end > 0 && insts[end - 1].IsTerminator()) {
+      end--;
+    }
+    size_t begin = 0;
+    for (size_t i = 0; i <= end; i++) {
+      if (i == end || insts[i].op == MOp::kCall || insts[i].IsBranch()) {
+        ScheduleRegion(insts, begin, i, cpu);
+        begin = i + 1;
+      }
+    }
+  }
+}
@@ -0,0 +1,339 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "IR.hpp"
+#include "ModRef.hpp"
+
+// 代数化简: 常量折叠, 恒等式 (x + 0, x * 1, x - x, !!c ...), 常量放到右边, 以及把
+// (x op c1) op c2 重结合成 x op (c1 op c2). 所有变换都按 32 位补码回绕成立, 不依赖
+// "有符号溢出不会发生". 前端把每次变量读取都生成一条 load, 所以先在块内做 load 转发,
+// 同一个变量的两次读取才能被认出是同一个值
+
+static bool IsCommutative(koopa_raw_binary_op_t op) {
+  switch (op) {
+    case KOOPA_RBO_ADD:
+    case KOOPA_RBO_MUL:
+    case KOOPA_RBO_AND:
+    case KOOPA_RBO_OR:
+    case KOOPA_RBO_XOR:
+    case KOOPA_RBO_EQ:
+    case KOOPA_RBO_NOT_EQ:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// 模 2^32 下满足结合律的运算
+static bool IsAssociative(koopa_raw_binary_op_t op) {
+  switch (op) {
+    case KOOPA_RBO_ADD:
+    case KOOPA_RBO_MUL:
+    case KOOPA_RBO_AND:
+    case KOOPA_RBO_OR:
+    case KOOPA_RBO_XOR:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool IsBinary(koopa_raw_value_t value, koopa_raw_binary_op_t op) {
+  return value->kind.tag == KOOPA_RVT_BINARY && value->kind.data.binary.op == op;
+}
+
+static void SetBinary(koopa_raw_value_t inst, koopa_raw_binary_op_t op, koopa_raw_value_t lhs,
+                      koopa_raw_value_t rhs) {
+  auto &bin = Mut(inst)->kind.data.binary;
+  bin.op = op;
+  bin.lhs = lhs;
+  bin.rhs = rhs;
+}
+
+// 化简一次 binary 指令. 能化简成已有的值时返回这个值; 能改写成更简单的形式时原地修改
+// 指令并返回它本身, changed 置为 true
+static koopa_raw_value_t SimplifyBinaryOnce(IRArena &arena, koopa_raw_value_t inst,
+                                            bool &changed) {
+  const auto &bin = inst->kind.data.binary;
+  auto op = bin.op;
+  auto lhs = bin.lhs, rhs = bin.rhs;
+  changed = false;
+  int32_t result;
+  if (IsInteger(lhs) && IsInteger(rhs)) {
+    if (FoldBinary(op, lhs->kind.data.integer.value, rhs->kind.data.integer.value, result)) {
+      return arena.Integer(result);
+    }
+    return inst;
+  }
+  // 常量放到右边
+  if (IsInteger(lhs) && (IsCommutative(op) || SwapCompare(op) != op)) {
+    SetBinary(inst, SwapCompare(op), rhs, lhs);
+    changed = true;
+    return inst;
+  }
+  // 两个操作数相同
+  if (lhs == rhs) {
+    switch (op) {
+      case KOOPA_RBO_SUB:
+      case KOOPA_RBO_XOR:
+      case KOOPA_RBO_NOT_EQ:
+      case KOOPA_RBO_LT:
+      case KOOPA_RBO_GT:
+        return arena.Integer(0);
+      case KOOPA_RBO_EQ:
+      case KOOPA_RBO_LE:
+      case KOOPA_RBO_GE:
+        return arena.Integer(1);
+      case KOOPA_RBO_AND:
+      case KOOPA_RBO_OR:
+        return lhs;
+      default:
+        break;
+    }
+  }
+  // 0 - (a - b) => b - a, 其中包括 -(-x) => x - 0
+  if (op == KOOPA_RBO_SUB && IsInteger(lhs, 0) && IsBinary(rhs, KOOPA_RBO_SUB)) {
+    SetBinary(inst, KOOPA_RBO_SUB, rhs->kind.data.binary.rhs, rhs->kind.data.binary.lhs);
+    changed = true;
+    return inst;
+  }
+  // x + (0 - y) => x - y, x - (0 - y) => x + y
+  if ((op == KOOPA_RBO_ADD || op == KOOPA_RBO_SUB) && IsBinary(rhs, KOOPA_RBO_SUB) &&
+      IsInteger(rhs->kind.data.binary.lhs, 0)) {
+    auto y = rhs->kind.data.binary.rhs;
+    SetBinary(inst, op == KOOPA_RBO_ADD ? KOOPA_RBO_SUB : KOOPA_RBO_ADD, lhs, y);
+    changed = true;
+    return inst;
+  }
+  if (op == KOOPA_RBO_ADD && IsBinary(lhs, KOOPA_RBO_SUB) &&
+      IsInteger(lhs->kind.data.binary.lhs, 0)) {
+    SetBinary(inst, KOOPA_RBO_SUB, rhs, lhs->kind.data.binary.rhs);
+    changed = true;
+    return inst;
+  }
+  if (!IsInteger(rhs)) {
+    return inst;
+  }
+  int32_t c = rhs->kind.data.integer.value;
+  // x - c => x + (-c), 统一成加法之后才能和其他加法重结合
+  if (op == KOOPA_RBO_SUB && c != 0) {
+    SetBinary(inst, KOOPA_RBO_ADD, lhs, arena.Integer((int32_t)(0u - (uint32_t)c)));
+    changed = true;
+    return inst;
+  }
+  // (x op c1) op c2 => x op (c1 op c2)
+  if (IsAssociative(op) && IsBinary(lhs, op) && IsInteger(lhs->kind.data.binary.rhs)) {
+    FoldBinary(op, lhs->kind.data.binary.rhs->kind.data.integer.value, c, result);
+    SetBinary(inst, op, lhs->kind.data.binary.lhs, arena.Integer(result));
+    changed = true;
+    return inst;
+  }
+  switch (op) {
+    case KOOPA_RBO_ADD:
+    case KOOPA_RBO_SUB:
+    case KOOPA_RBO_OR:
+    case KOOPA_RBO_XOR:
+    case KOOPA_RBO_SHL:
+    case KOOPA_RBO_SHR:
+    case KOOPA_RBO_SAR:
+      if (c == 0) {
+        return lhs;
+      }
+      if (op == KOOPA_RBO_OR && c == -1) {
+        return rhs;
+      }
+      break;
+    case KOOPA_RBO_MUL:
+    case KOOPA_RBO_DIV:
+      if (c == 1) {
+        return lhs;
+      }
+      if (op == KOOPA_RBO_MUL && c == 0) {
+        return rhs;
+      }
+      // x * -1 和 x / -1 都是 0 - x (INT_MIN / -1 回绕成 INT_MIN)
+      if (c == -1) {
+        SetBinary(inst, KOOPA_RBO_SUB, arena.Integer(0), lhs);
+        changed = true;
+        return inst;
+      }
+      break;
+    case KOOPA_RBO_MOD:
+      if (c == 1 || c == -1) {
+        return arena.Integer(0);
+      }
+      break;
+    case KOOPA_RBO_AND:
+      if (c == 0) {
+        return rhs;
+      }
+      if (c == -1) {
+        return lhs;
+      }
+      break;
+    case KOOPA_RBO_EQ:
+    case KOOPA_RBO_NOT_EQ:
+      // 布尔值和 0/1 比较就是它本身或者取反, 和其他常量比较的结果是确定的
+      if (IsCompare(lhs) && (c == 0 || c == 1)) {
+        if ((op == KOOPA_RBO_NOT_EQ) == (c == 0)) {
+          return lhs;
+        }
+        const auto &cmp = lhs->kind.data.binary;
+        SetBinary(inst, InvertCompare(cmp.op), cmp.lhs, cmp.rhs);
+        changed = true;
+        return inst;
+      }
+      if (IsCompare(lhs)) {
+        return arena.Integer(op == KOOPA_RBO_NOT_EQ);
+      }
+      break;
+    case KOOPA_RBO_LT:
+    case KOOPA_RBO_GE:
+      if (c == INT32_MIN) {
+        return arena.Integer(op == KOOPA_RBO_GE);
+      }
+      break;
+    case KOOPA_RBO_GT:
+    case KOOPA_RBO_LE:
+      if (c == INT32_MAX) {
+        return arena.Integer(op == KOOPA_RBO_LE);
+      }
+      break;
+    default:
+      break;
+  }
+  return inst;
+}
+
+static koopa_raw_value_t SimplifyBinary(IRArena &arena, koopa_raw_value_t inst) {
+  bool changed = true;
+  while (changed) {
+    koopa_raw_value_t result = SimplifyBinaryOnce(arena, inst, changed);
+    if (result != inst) {
+      return result;
+    }
+  }
+  return inst;
+}
+
+// 块内的 load 转发, 纯函数调用的公共子表达式消除和代数化简. 记住每个变量当前的值:
+// store 之后是存进去的值, load 之后是 load 的结果, 再次 load 时直接用这个值.
+// 参数不转发, 参数的 alloc 在后端会直接和传参寄存器合并
+static bool SimplifyBlock(IRArena &arena, koopa_raw_basic_block_t bb,
+                          std::unordered_map<koopa_raw_value_t, koopa_raw_value_t> &replaced,
+                          const ModRefAnalysis &modref) {
+  std::unordered_map<koopa_raw_value_t, koopa_raw_value_t> known;
+  // 之前的纯函数调用, 它们读的全局变量被写过之后就不能再用了
+  std::vector<koopa_raw_value_t> pure_calls;
+  auto forget_calls = [&](const std::unordered_set<koopa_raw_value_t> &vars) {
+    pure_calls.erase(std::remove_if(pure_calls.begin(), pure_calls.end(),
+                                    [&](koopa_raw_value_t call) {
+                                      for (auto var : modref.Get(call).reads) {
+                                        if (vars.count(var)) {
+                                          return true;
+                                        }
+                                      }
+                                      return false;
+                                    }),
+                     pure_calls.end());
+  };
+  std::vector<koopa_raw_value_t> kept;
+  bool changed = false;
+  for (auto inst : Insts(bb)) {
+    for (auto slot : OperandSlots(inst)) {
+      for (auto it = replaced.find(*slot); it != replaced.end(); it = replaced.find(*slot)) {
+        *slot = it->second;
+      }
+    }
+    const auto &kind = inst->kind;
+    switch (kind.tag) {
+      case KOOPA_RVT_LOAD: {
+        auto it = known.find(kind.data.load.src);
+        if (it != known.end()) {
+          replaced[inst] = it->second;
+          changed = true;
+          continue;
+        }
+        known[kind.data.load.src] = inst;
+        break;
+      }
+      case KOOPA_RVT_STORE:
+        if (kind.data.store.value->kind.tag == KOOPA_RVT_FUNC_ARG_REF) {
+          known.erase(kind.data.store.dest);
+        } else {
+          known[kind.data.store.dest] = kind.data.store.value;
+        }
+        forget_calls({kind.data.store.dest});
+        break;
+      case KOOPA_RVT_CALL: {
+        const FunctionEffects &effects = modref.Get(inst);
+        if (effects.Pure() && inst->ty->tag != KOOPA_RTT_UNIT) {
+          auto same = std::find_if(pure_calls.begin(), pure_calls.end(),
+                                   [&](koopa_raw_value_t call) { return SameCall(call, inst); });
+          if (same != pure_calls.end()) {
+            replaced[inst] = *same;
+            changed = true;
+            continue;
+          }
+          pure_calls.push_back(inst);
+        }
+        forget_calls(effects.writes);
+        // 跨过 call 的值在后端只能放在栈上, 局部变量不如重新 load. 常量, 以及 call 不会写的
+        // 全局变量 (重新 load 还要先算地址) 继续转发
+        for (auto it = known.begin(); it != known.end();) {
+          auto var = it->first;
+          if (modref.MayWrite(inst, var) ||
+              (!ModRefAnalysis::IsGlobal(var) && !IsInteger(it->second))) {
+            it = known.erase(it);
+          } else {
+            ++it;
+          }
+        }
+        break;
+      }
+      case KOOPA_RVT_BINARY: {
+        auto result = SimplifyBinary(arena, inst);
+        if (result != inst) {
+          replaced[inst] = result;
+          changed = true;
+          continue;
+        }
+        break;
+      }
+      case KOOPA_RVT_BRANCH:
+        // 条件是常量的分支改成 jump
+        if (IsInteger(kind.data.branch.cond)) {
+          const auto &branch = kind.data.branch;
+          kept.push_back(arena.Jump(IsInteger(branch.cond, 0) ? branch.false_bb : branch.true_bb));
+          changed = true;
+          continue;
+        }
+        break;
+      default:
+        break;
+    }
+    kept.push_back(inst);
+  }
+  if (changed) {
+    SetInsts(arena, bb, kept);
+  }
+  return changed;
+}
+
+static bool SimplifyFunction(IRArena &arena, koopa_raw_function_t func,
+                             const ModRefAnalysis &modref) {
+  std::unordered_map<koopa_raw_value_t, koopa_raw_value_t> replaced;
+  bool changed = MergeBlocks(arena, func);
+  for (size_t b = 0; b < func->bbs.len; b++) {
+    changed |= SimplifyBlock(arena, SliceAt<koopa_raw_basic_block_t>(func->bbs, b), replaced,
+                             modref);
+  }
+  ReplaceUses(func, replaced);
+  changed |= RemoveUnreachableBlocks(arena, func);
+  changed |= RemoveUnusedValues(arena, func);
+  return changed;
+}
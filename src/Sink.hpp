@@ -0,0 +1,222 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "IR.hpp"
+#include "ModRef.hpp"
+
+// 代码下沉: 以条件分支结尾的块里, 只在一个分支里用到的计算挪进这个分支的开头, 另一条路径上
+// 就不用算了 (比如 if 里才用到的值, break 之前才用到的值). 能挪的是结果只在那个分支里用的
+// 运算和 load, 以及存进局部变量, 而另一个分支开头这个变量不再活跃的 store.
+// 目标块只能有这一个前驱, 挪进去的指令保持原来的顺序, 目标块里还可以继续往下沉
+
+// 局部变量在每个块开头是否活跃 (之后可能在 store 之前被 load)
+static std::unordered_map<koopa_raw_basic_block_t, std::unordered_set<koopa_raw_value_t>>
+LocalsLiveIn(koopa_raw_function_t func) {
+  std::unordered_map<koopa_raw_basic_block_t, std::unordered_set<koopa_raw_value_t>> live_in;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t b = func->bbs.len; b-- > 0;) {
+      auto bb = SliceAt<koopa_raw_basic_block_t>(func->bbs, b);
+      std::unordered_set<koopa_raw_value_t> live;
+      for (auto succ : Successors(bb)) {
+        live.insert(live_in[succ].begin(), live_in[succ].end());
+      }
+      std::vector<koopa_raw_value_t> insts = Insts(bb);
+      for (auto it = insts.rbegin(); it != insts.rend(); ++it) {
+        const auto &kind = (*it)->kind;
+        if (kind.tag == KOOPA_RVT_LOAD && kind.data.load.src->kind.tag == KOOPA_RVT_ALLOC) {
+          live.insert(kind.data.load.src);
+        } else if (kind.tag == KOOPA_RVT_STORE) {
+          live.erase(kind.data.store.dest);
+        }
+      }
+      if (live != live_in[bb]) {
+        live_in[bb] = live;
+        changed = true;
+      }
+    }
+  }
+  return live_in;
+}
+
+static bool SinkCode(IRArena &arena, koopa_raw_function_t func, const ModRefAnalysis &modref) {
+  auto live_in = LocalsLiveIn(func);
+  auto preds = PredecessorCounts(func);
+  std::unordered_map<koopa_raw_value_t, std::vector<koopa_raw_value_t>> users;
+  std::unordered_map<koopa_raw_value_t, koopa_raw_basic_block_t> block_of;
+  for (size_t b = 0; b < func->bbs.len; b++) {
+    auto bb = SliceAt<koopa_raw_basic_block_t>(func->bbs, b);
+    for (auto inst : Insts(bb)) {
+      block_of[inst] = bb;
+      for (auto slot : OperandSlots(inst)) {
+        users[*slot].push_back(inst);
+      }
+    }
+  }
+
+  bool changed = false;
+  // 前驱先于后继处理, 沉到后继里的指令还可以继续下沉
+  for (auto bb : ReversePostOrder(func)) {
+    std::vector<koopa_raw_value_t> insts = Insts(bb);
+    const auto &term = insts.back()->kind;
+    if (term.tag != KOOPA_RVT_BRANCH || term.data.branch.true_bb == term.data.branch.false_bb) {
+      continue;
+    }
+    koopa_raw_basic_block_t targets[] = {term.data.branch.true_bb, term.data.branch.false_bb};
+    // 每条指令沉到哪个分支, 留在块里的不在表里. pinned 里的指令一定留在块里
+    auto choose = [&](const std::unordered_set<koopa_raw_value_t> &pinned) {
+      std::unordered_map<koopa_raw_value_t, koopa_raw_basic_block_t> sunk;
+      // 在正在考虑的指令之后, 留在块里的指令读写的变量和可能写全局变量的调用,
+      // 以及沉到每个分支的指令读写的变量
+      std::unordered_set<koopa_raw_value_t> loaded, stored;
+      std::vector<koopa_raw_value_t> calls;
+      std::unordered_map<koopa_raw_basic_block_t, std::unordered_set<koopa_raw_value_t>>
+          sunk_loaded, sunk_stored;
+      auto can_sink = [&](koopa_raw_value_t inst, koopa_raw_basic_block_t target,
+                          koopa_raw_basic_block_t other) {
+        if (preds[target] != 1 || target == bb || pinned.count(inst)) {
+          return false;
+        }
+        const auto &kind = inst->kind;
+        if (kind.tag == KOOPA_RVT_STORE) {
+          // 入口处把参数存进 alloc 的 store 留着, 后端靠它把 alloc 放进传参的寄存器
+          auto dest = kind.data.store.dest;
+          return dest->kind.tag == KOOPA_RVT_ALLOC &&
+                 kind.data.store.value->kind.tag != KOOPA_RVT_FUNC_ARG_REF &&
+                 !live_in[other].count(dest) && !loaded.count(dest) && !stored.count(dest) &&
+                 !sunk_loaded[other].count(dest) && !sunk_stored[other].count(dest);
+        }
+        if (kind.tag == KOOPA_RVT_LOAD) {
+          auto src = kind.data.load.src;
+          if (stored.count(src) || std::any_of(calls.begin(), calls.end(), [&](auto call) {
+                return modref.MayWrite(call, src);
+              })) {
+            return false;
+          }
+        } else if (kind.tag != KOOPA_RVT_BINARY) {
+          return false;
+        }
+        const auto &uses = users[inst];
+        return !uses.empty() && std::all_of(uses.begin(), uses.end(), [&](auto user) {
+          auto it = sunk.find(user);
+          return it != sunk.end() ? it->second == target : block_of[user] == target;
+        });
+      };
+      for (size_t i = insts.size() - 1; i-- > 0;) {
+        auto inst = insts[i];
+        koopa_raw_basic_block_t target = nullptr;
+        if (can_sink(inst, targets[0], targets[1])) {
+          target = targets[0];
+        } else if (can_sink(inst, targets[1], targets[0])) {
+          target = targets[1];
+        }
+        if (target) {
+          sunk[inst] = target;
+        }
+        const auto &kind = inst->kind;
+        if (kind.tag == KOOPA_RVT_LOAD) {
+          (target ? sunk_loaded[target] : loaded).insert(kind.data.load.src);
+        } else if (kind.tag == KOOPA_RVT_STORE) {
+          (target ? sunk_stored[target] : stored).insert(kind.data.store.dest);
+        } else if (kind.tag == KOOPA_RVT_CALL) {
+          calls.push_back(inst);
+        }
+      }
+      return sunk;
+    };
+    // 留在块里的值到了分支开头还能从哪个变量里重新 load 出来: load 出它的变量, 或者存进去的局部
+    // 变量, 之后在块里都不再被改写. 存进变量的 store 也要留在块里: 值 -> (变量, store)
+    std::unordered_map<koopa_raw_value_t, std::pair<koopa_raw_value_t, koopa_raw_value_t>> reload;
+    std::unordered_set<koopa_raw_value_t> written;
+    for (size_t i = insts.size(); i-- > 0;) {
+      auto inst = insts[i];
+      const auto &kind = inst->kind;
+      if (kind.tag == KOOPA_RVT_LOAD && !written.count(kind.data.load.src)) {
+        reload.insert({inst, {kind.data.load.src, nullptr}});
+      } else if (kind.tag == KOOPA_RVT_STORE) {
+        auto dest = kind.data.store.dest;
+        if (dest->kind.tag == KOOPA_RVT_ALLOC && !written.count(dest)) {
+          reload.insert({kind.data.store.value, {dest, inst}});
+        }
+        written.insert(dest);
+      } else if (kind.tag == KOOPA_RVT_CALL) {
+        const auto &writes = modref.Get(inst).writes;
+        written.insert(writes.begin(), writes.end());
+      }
+    }
+    // 其余操作数留在块里的指令不能挪: 后端把跨块使用的值放在栈上, 比在两条路径上都算一遍还慢.
+    // 要从变量里重新 load 时, 存进这个变量的 store 留在块里. 留下一条指令可能让之前的决定
+    // 不再成立, 所以每次都重新选
+    std::unordered_map<koopa_raw_value_t, koopa_raw_basic_block_t> sunk;
+    // 挪走的指令用到的, 留在块里的值
+    auto stays = [&](koopa_raw_value_t value) {
+      auto it = block_of.find(value);
+      return it != block_of.end() && it->second == bb && value->kind.tag != KOOPA_RVT_ALLOC &&
+             !sunk.count(value);
+    };
+    std::unordered_set<koopa_raw_value_t> pinned;
+    sunk = choose(pinned);
+    for (bool repeat = true; repeat;) {
+      repeat = false;
+      for (const auto &[inst, target] : sunk) {
+        for (auto slot : OperandSlots(inst)) {
+          if (!stays(*slot)) {
+            continue;
+          }
+          auto it = reload.find(*slot);
+          auto pin = it == reload.end() ? inst : it->second.second;
+          if (pin && sunk.count(pin)) {
+            pinned.insert(pin);
+            repeat = true;
+          }
+        }
+      }
+      if (repeat) {
+        sunk = choose(pinned);
+      }
+    }
+    if (sunk.empty()) {
+      continue;
+    }
+    std::vector<koopa_raw_value_t> kept;
+    std::unordered_map<koopa_raw_basic_block_t, std::vector<koopa_raw_value_t>> moved;
+    std::map<std::pair<koopa_raw_basic_block_t, koopa_raw_value_t>, koopa_raw_value_t> reloads;
+    for (auto inst : insts) {
+      auto it = sunk.find(inst);
+      if (it == sunk.end()) {
+        kept.push_back(inst);
+        continue;
+      }
+      auto target = it->second;
+      for (auto slot : OperandSlots(inst)) {
+        if (!stays(*slot)) {
+          continue;
+        }
+        auto &load = reloads[{target, *slot}];
+        if (!load) {
+          load = arena.Load(reload.at(*slot).first);
+          moved[target].push_back(load);
+          block_of[load] = target;
+        }
+        users[load].push_back(inst);
+        *slot = load;
+      }
+      moved[target].push_back(inst);
+      block_of[inst] = target;
+    }
+    SetInsts(arena, bb, kept);
+    for (auto &[target, code] : moved) {
+      std::vector<koopa_raw_value_t> target_insts = Insts(target);
+      code.insert(code.end(), target_insts.begin(), target_insts.end());
+      SetInsts(arena, target, code);
+    }
+    changed = true;
+  }
+  return changed;
+}
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "IR.hpp"
+#include "KnownBits.hpp"
+#include "ModRef.hpp"
+#include "Simplify.hpp"
+
+// 函数特化: 同一组常量参数调用得多的函数复制一份, 副本里把这些参数换成常量再化简.
+// 递归函数里原样传下去的常量参数 (比如模式标志) 化简后也是常量, 递归调用同样改成调用副本.
+// 副本的签名不变, 调用处仍然传这些常量, 用不到的参数留给删除无用参数的优化
+
+// 被特化的函数最多的指令数
+static const size_t kMaxSpecializeSize = 200;
+// 所有副本加起来最多的指令数
+static const size_t kSpecializeBudget = 600;
+// 每个函数最多的副本数
+static const size_t kMaxSpecializations = 4;
+
+// 一组常量参数: (参数下标, 常量)
+using ConstantArgs = std::vector<std::pair<size_t, int32_t>>;
+
+struct Specialization {
+  koopa_raw_function_t callee;
+  ConstantArgs args;
+  koopa_raw_function_t clone;
+};
+
+static size_t InstCount(koopa_raw_function_t func) {
+  size_t count = 0;
+  for (size_t b = 0; b < func->bbs.len; b++) {
+    count += SliceAt<koopa_raw_basic_block_t>(func->bbs, b)->insts.len;
+  }
+  return count;
+}
+
+static ConstantArgs CallConstantArgs(koopa_raw_value_t call) {
+  ConstantArgs args;
+  const auto &data = call->kind.data.call;
+  for (size_t i = 0; i < data.args.len; i++) {
+    auto arg = SliceAt<koopa_raw_value_t>(data.args, i);
+    if (IsInteger(arg)) {
+      args.push_back({i, arg->kind.data.integer.value});
+    }
+  }
+  return args;
+}
+
+// 调用传的参数包含 args 中所有的常量
+static bool MatchesSpecialization(koopa_raw_value_t call, const Specialization &spec) {
+  const auto &data = call->kind.data.call;
+  if (data.callee != spec.callee) {
+    return false;
+  }
+  return std::all_of(spec.args.begin(), spec.args.end(), [&](const auto &arg) {
+    return IsInteger(SliceAt<koopa_raw_value_t>(data.args, arg.first), arg.second);
+  });
+}
+
+// 复制整个函数, 副本里的值和基本块都是新建的, 全局变量和常量和原函数共用
+static koopa_raw_function_data_t *CloneFunction(IRArena &arena, koopa_raw_function_t func,
+                                                const std::string &name) {
+  koopa_raw_function_data_t *clone = arena.NewFunction(func->ty, name);
+  std::unordered_map<koopa_raw_value_t, koopa_raw_value_t> values;
+  std::unordered_map<koopa_raw_basic_block_t, koopa_raw_basic_block_t> blocks;
+  auto copy = [&](koopa_raw_value_t value) {
+    koopa_raw_value_data_t *result = arena.NewValue(value->ty, value->kind.tag);
+    result->name = value->name;
+    result->kind = value->kind;
+    values[value] = result;
+    return result;
+  };
+  std::vector<const void *> params;
+  for (size_t i = 0; i < func->params.len; i++) {
+    params.push_back(copy(SliceAt<koopa_raw_value_t>(func->params, i)));
+  }
+  clone->params = arena.Slice(params, KOOPA_RSIK_VALUE);
+  std::vector<const void *> bbs;
+  for (size_t b = 0; b < func->bbs.len; b++) {
+    auto bb = SliceAt<koopa_raw_basic_block_t>(func->bbs, b);
+    koopa_raw_basic_block_data_t *block = arena.NewBlock();
+    block->name = bb->name;
+    blocks[bb] = block;
+    bbs.push_back(block);
+  }
+  clone->bbs = arena.Slice(bbs, KOOPA_RSIK_BASIC_BLOCK);
+  for (size_t b = 0; b < func->bbs.len; b++) {
+    auto bb = SliceAt<koopa_raw_basic_block_t>(func->bbs, b);
+    std::vector<koopa_raw_value_t> insts;
+    for (auto inst : Insts(bb)) {
+      koopa_raw_value_data_t *result = copy(inst);
+      auto &kind = result->kind;
+      // 操作数放在 slice 里的指令要有自己的 slice
+      if (kind.tag == KOOPA_RVT_CALL) {
+        const auto &args = kind.data.call.args;
+        kind.data.call.args =
+            arena.Slice(std::vector<const void *>(args.buffer, args.buffer + args.len),
+                        KOOPA_RSIK_VALUE);
+      } else if (kind.tag == KOOPA_RVT_BRANCH) {
+        kind.data.branch.true_bb = blocks.at(kind.data.branch.true_bb);
+        kind.data.branch.false_bb = blocks.at(kind.data.branch.false_bb);
+        kind.data.branch.true_args = arena.Slice({}, KOOPA_RSIK_VALUE);
+        kind.data.branch.false_args = arena.Slice({}, KOOPA_RSIK_VALUE);
+      } else if (kind.tag == KOOPA_RVT_JUMP) {
+        kind.data.jump.target = blocks.at(kind.data.jump.target);
+        kind.data.jump.args = arena.Slice({}, KOOPA_RSIK_VALUE);
+      }
+      insts.push_back(result);
+    }
+    SetInsts(arena, blocks.at(bb), insts);
+  }
+  for (size_t b = 0; b < clone->bbs.len; b++) {
+    for (auto inst : Insts(SliceAt<koopa_raw_basic_block_t>(clone->bbs, b))) {
+      for (auto slot : OperandSlots(inst)) {
+        auto it = values.find(*slot);
+        if (it != values.end()) {
+          *slot = it->second;
+        }
+      }
+    }
+  }
+  return clone;
+}
+
+// 把调用改成调用匹配的副本, 常量多的副本优先
+static bool RedirectSpecializedCalls(const koopa_raw_program_t &program,
+                                     const std::vector<Specialization> &specs) {
+  bool changed = false;
+  for (size_t f = 0; f < program.funcs.len; f++) {
+    auto func = SliceAt<koopa_raw_function_t>(program.funcs, f);
+    for (size_t b = 0; b < func->bbs.len; b++) {
+      for (auto inst : Insts(SliceAt<koopa_raw_basic_block_t>(func->bbs, b))) {
+        if (inst->kind.tag != KOOPA_RVT_CALL) {
+          continue;
+        }
+        const Specialization *best = nullptr;
+        for (const auto &spec : specs) {
+          if (MatchesSpecialization(inst, spec) &&
+              (!best || spec.args.size() > best->args.size())) {
+            best = &spec;
+          }
+        }
+        if (best) {
+          Mut(inst)->kind.data.call.callee = best->clone;
+          changed = true;
+        }
+      }
+    }
+  }
+  return changed;
+}
+
+static bool SpecializeFunctions(IRArena &arena, koopa_raw_program_t &program) {
+  // 每个 (函数, 常量参数) 被调用的次数, 按第一次出现的顺序
+  std::map<std::pair<koopa_raw_function_t, ConstantArgs>, size_t> counts;
+  std::vector<std::pair<koopa_raw_function_t, ConstantArgs>> patterns;
+  for (size_t f = 0; f < program.funcs.len; f++) {
+    auto func = SliceAt<koopa_raw_function_t>(program.funcs, f);
+    for (size_t b = 0; b < func->bbs.len; b++) {
+      for (auto inst : Insts(SliceAt<koopa_raw_basic_block_t>(func->bbs, b))) {
+        if (inst->kind.tag != KOOPA_RVT_CALL) {
+          continue;
+        }
+        auto callee = inst->kind.data.call.callee;
+        ConstantArgs args = CallConstantArgs(inst);
+        if (callee->bbs.len == 0 || args.empty() || InstCount(callee) > kMaxSpecializeSize) {
+          continue;
+        }
+        if (counts[{callee, args}]++ == 0) {
+          patterns.push_back({callee, args});
+        }
+      }
+    }
+  }
+  std::stable_sort(patterns.begin(), patterns.end(),
+                   [&](const auto &a, const auto &b) { return counts[a] > counts[b]; });
+
+  std::vector<Specialization> specs;
+  std::unordered_map<koopa_raw_function_t, size_t> clones;
+  std::vector<const void *> funcs(program.funcs.buffer, program.funcs.buffer + program.funcs.len);
+  size_t budget = kSpecializeBudget;
+  for (const auto &[callee, args] : patterns) {
+    size_t size = InstCount(callee);
+    if (size > budget || clones[callee] == kMaxSpecializations) {
+      continue;
+    }
+    budget -= size;
+    std::string name = std::string(callee->name) + ".spec" + std::to_string(clones[callee]++);
+    koopa_raw_function_data_t *clone = CloneFunction(arena, callee, name);
+    std::unordered_map<koopa_raw_value_t, koopa_raw_value_t> replaced;
+    for (const auto &[index, value] : args) {
+      replaced[SliceAt<koopa_raw_value_t>(clone->params, index)] = arena.Integer(value);
+    }
+    ReplaceUses(clone, replaced);
+    specs.push_back(Specialization{callee, args, clone});
+    funcs.push_back(clone);
+  }
+  if (specs.empty()) {
+    return false;
+  }
+  program.funcs = arena.Slice(funcs, KOOPA_RSIK_FUNCTION);
+  RedirectSpecializedCalls(program, specs);
+
+  // 副本里传播常量之后, 递归调用的参数可能也变成了同样的常量
+  ModRefAnalysis modref(program);
+  for (const auto &spec : specs) {
+    SimplifyFunction(arena, spec.clone, modref);
+    if (SimplifyKnownBits(arena, spec.clone)) {
+      SimplifyFunction(arena, spec.clone, modref);
+    }
+  }
+  RedirectSpecializedCalls(program, specs);
+  return true;
+}
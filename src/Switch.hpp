@@ -0,0 +1,209 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "IR.hpp"
+
+// if-else-if 里同一个值和一串常量的相等比较:
+//   B0: br (eq x, k0), T0, B1    B1: br (eq x, k1), T1, B2    ...    Bn: br (eq x, kn), Tn, D
+// 后面的块里只有 (重新 load 同一个变量的) load, eq 和 br. 常量足够稠密时后端生成跳转表:
+// 一次范围检查, 从 .rodata 里的地址表取出目标再 jr; 稀疏的在 IR 上改写成按常量二分的
+// 判定树, 比较次数从 n 降到 log n
+
+static const size_t kMinSwitchCases = 4;
+// 跳转表至少要有的分支数, 太少时判定树更快
+static const size_t kMinJumpTableCases = 6;
+// 跳转表最多的项数, 而且至少一半的项是真正的分支
+static const int64_t kMaxJumpTableSize = 1024;
+// 判定树的叶子里最多顺序比较几个常量
+static const size_t kMaxLinearCases = 3;
+
+struct SwitchChain {
+  koopa_raw_basic_block_t head;
+  koopa_raw_value_t value;
+  // 按在链里出现的顺序, 重复的常量只有第一次出现的有效
+  std::vector<std::pair<int32_t, koopa_raw_basic_block_t>> cases;
+  koopa_raw_basic_block_t default_bb;
+  // 链上 head 之后的块, 换成跳转表或者判定树之后都不再可达
+  std::vector<koopa_raw_basic_block_t> blocks;
+
+  int32_t Low() const {
+    int32_t low = cases[0].first;
+    for (const auto &[k, target] : cases) {
+      low = std::min(low, k);
+    }
+    return low;
+  }
+
+  int32_t High() const {
+    int32_t high = cases[0].first;
+    for (const auto &[k, target] : cases) {
+      high = std::max(high, k);
+    }
+    return high;
+  }
+};
+
+// bb 以 br (eq x, k) 结尾时返回这个 eq
+static koopa_raw_value_t CaseCompare(koopa_raw_basic_block_t bb) {
+  if (bb->insts.len < 2) {
+    return nullptr;
+  }
+  auto term = SliceAt<koopa_raw_value_t>(bb->insts, bb->insts.len - 1);
+  auto cmp = SliceAt<koopa_raw_value_t>(bb->insts, bb->insts.len - 2);
+  if (term->kind.tag != KOOPA_RVT_BRANCH || term->kind.data.branch.cond != cmp ||
+      cmp->kind.tag != KOOPA_RVT_BINARY || cmp->kind.data.binary.op != KOOPA_RBO_EQ ||
+      !IsInteger(cmp->kind.data.binary.rhs)) {
+    return nullptr;
+  }
+  return cmp;
+}
+
+// head 里的 x 是 load 时, 之后变量不能再被写, 后面的块重新 load 才能得到同一个值
+static bool StableInHead(koopa_raw_basic_block_t head, koopa_raw_value_t x) {
+  if (x->kind.tag != KOOPA_RVT_LOAD) {
+    return true;
+  }
+  std::vector<koopa_raw_value_t> insts = Insts(head);
+  auto it = std::find(insts.begin(), insts.end(), x);
+  if (it == insts.end()) {
+    return false;
+  }
+  for (++it; it != insts.end(); ++it) {
+    const auto &kind = (*it)->kind;
+    if (kind.tag == KOOPA_RVT_CALL ||
+        (kind.tag == KOOPA_RVT_STORE && kind.data.store.dest == x->kind.data.load.src)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// bb 只是比较链的下一环: 直接比较 x, 或者重新 load x 的变量再比较
+static bool IsCaseBlock(koopa_raw_basic_block_t bb, koopa_raw_value_t cmp, koopa_raw_value_t x) {
+  auto lhs = cmp->kind.data.binary.lhs;
+  if (bb->insts.len == 2) {
+    return lhs == x;
+  }
+  return bb->insts.len == 3 && SliceAt<koopa_raw_value_t>(bb->insts, 0) == lhs &&
+         lhs->kind.tag == KOOPA_RVT_LOAD && x->kind.tag == KOOPA_RVT_LOAD &&
+         lhs->kind.data.load.src == x->kind.data.load.src;
+}
+
+// 从 head 开始沿 false 分支收集比较链
+static SwitchChain CollectSwitchChain(
+    koopa_raw_function_t func, koopa_raw_basic_block_t head,
+    const std::unordered_map<koopa_raw_basic_block_t, int> &preds) {
+  SwitchChain chain{.head = head, .value = CaseCompare(head)->kind.data.binary.lhs};
+  std::unordered_set<int32_t> seen;
+  std::unordered_set<koopa_raw_basic_block_t> visited = {head};
+  auto bb = head;
+  while (true) {
+    auto cmp = CaseCompare(bb);
+    const auto &branch = SliceAt<koopa_raw_value_t>(bb->insts, bb->insts.len - 1)->kind.data.branch;
+    int32_t k = cmp->kind.data.binary.rhs->kind.data.integer.value;
+    if (seen.insert(k).second) {
+      chain.cases.push_back({k, branch.true_bb});
+    }
+    auto next = branch.false_bb;
+    chain.default_bb = next;
+    auto next_cmp = CaseCompare(next);
+    if (visited.count(next) || preds.at(next) != 1 || !next_cmp ||
+        !IsCaseBlock(next, next_cmp, chain.value) || ValuesEscape(func, next)) {
+      break;
+    }
+    visited.insert(next);
+    chain.blocks.push_back(next);
+    bb = next;
+  }
+  return chain;
+}
+
+// 函数里所有至少有 kMinSwitchCases 个分支的比较链, 每条链只从它的第一个块开始算一次
+static std::vector<SwitchChain> FindSwitchChains(koopa_raw_function_t func) {
+  std::unordered_map<koopa_raw_basic_block_t, int> preds = PredecessorCounts(func);
+  std::unordered_set<koopa_raw_basic_block_t> covered;
+  std::vector<SwitchChain> chains;
+  for (auto bb : ReversePostOrder(func)) {
+    auto cmp = CaseCompare(bb);
+    if (covered.count(bb) || !cmp || !StableInHead(bb, cmp->kind.data.binary.lhs)) {
+      continue;
+    }
+    SwitchChain chain = CollectSwitchChain(func, bb, preds);
+    covered.insert(chain.blocks.begin(), chain.blocks.end());
+    if (chain.cases.size() >= kMinSwitchCases) {
+      chains.push_back(chain);
+    }
+  }
+  return chains;
+}
+
+static bool IsDenseSwitch(const SwitchChain &chain) {
+  int64_t range = (int64_t)chain.High() - chain.Low() + 1;
+  return chain.cases.size() >= kMinJumpTableCases && range <= kMaxJumpTableSize &&
+         range <= 2 * (int64_t)chain.cases.size();
+}
+
+// 在 bb 里 (insts 之后) 判定 cases[lo, hi), 都不相等时跳到 default. 新块里要重新 load x
+static void EmitDecisionTree(IRArena &arena, const SwitchChain &chain,
+                             const std::vector<std::pair<int32_t, koopa_raw_basic_block_t>> &cases,
+                             size_t lo, size_t hi, koopa_raw_basic_block_t bb,
+                             std::vector<koopa_raw_value_t> insts,
+                             std::vector<koopa_raw_basic_block_t> &blocks) {
+  koopa_raw_value_t x = chain.value;
+  if (bb != chain.head && x->kind.tag == KOOPA_RVT_LOAD) {
+    x = arena.Load(x->kind.data.load.src);
+    insts.push_back(x);
+  }
+  auto new_block = [&]() {
+    koopa_raw_basic_block_t block = arena.NewBlock();
+    blocks.push_back(block);
+    return block;
+  };
+  if (hi - lo <= kMaxLinearCases) {
+    auto cmp = arena.Binary(KOOPA_RBO_EQ, x, arena.Integer(cases[lo].first));
+    auto next = lo + 1 == hi ? chain.default_bb : new_block();
+    insts.push_back(cmp);
+    insts.push_back(arena.Branch(cmp, cases[lo].second, next));
+    SetInsts(arena, bb, insts);
+    if (lo + 1 < hi) {
+      EmitDecisionTree(arena, chain, cases, lo + 1, hi, next, {}, blocks);
+    }
+    return;
+  }
+  size_t mid = (lo + hi) / 2;
+  auto left = new_block(), right = new_block();
+  auto cmp = arena.Binary(KOOPA_RBO_LT, x, arena.Integer(cases[mid].first));
+  insts.push_back(cmp);
+  insts.push_back(arena.Branch(cmp, left, right));
+  SetInsts(arena, bb, insts);
+  EmitDecisionTree(arena, chain, cases, lo, mid, left, {}, blocks);
+  EmitDecisionTree(arena, chain, cases, mid, hi, right, {}, blocks);
+}
+
+// 稀疏的比较链改写成判定树, 稠密的留给后端生成跳转表
+static bool LowerSwitches(IRArena &arena, koopa_raw_function_t func) {
+  std::vector<koopa_raw_basic_block_t> blocks;
+  bool changed = false;
+  for (const SwitchChain &chain : FindSwitchChains(func)) {
+    if (IsDenseSwitch(chain)) {
+      continue;
+    }
+    auto cases = chain.cases;
+    std::sort(cases.begin(), cases.end());
+    std::vector<koopa_raw_value_t> insts = Insts(chain.head);
+    insts.pop_back();
+    EmitDecisionTree(arena, chain, cases, 0, cases.size(), chain.head, insts, blocks);
+    changed = true;
+  }
+  if (changed) {
+    AddBlocks(arena, func, blocks);
+    RemoveUnreachableBlocks(arena, func);
+    RemoveUnusedValues(arena, func);
+  }
+  return changed;
+}
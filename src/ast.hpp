@@ -256,6 +256,10 @@ class BaseAST {
       assert(false);
       return -1;
     }
+    // 不经过分支直接求值的代价 (大约的指令数), 有副作用或者可能很慢时返回 -1
+    virtual int EvalCost() const {
+      return -1;
+    }
 };
 
 class CompUnitAST : public BaseAST {
@@ -860,6 +864,10 @@ class IdentfierAST : public BaseAST {
       }
       return value.val;
     }
+
+    int EvalCost() const override {
+      return 1;
+    }
 };
 
 class NumberAST : public BaseAST {
@@ -878,6 +886,10 @@ class NumberAST : public BaseAST {
     int DumpExp(Environemt &env) const override {
       return val;
     }
+
+    int EvalCost() const override {
+      return 0;
+    }
 };
 
 class PrimaryExpAST : public BaseAST {
@@ -898,6 +910,10 @@ class PrimaryExpAST : public BaseAST {
     int DumpExp(Environemt &env) const override {
       return val->DumpExp(env);
     }
+
+    int EvalCost() const override {
+      return val->EvalCost();
+    }
 };
 
 class UnaryExpAST : public BaseAST {
@@ -958,6 +974,11 @@ class UnaryExpAST : public BaseAST {
           return 0;
       }
     }
+
+    int EvalCost() const override {
+      int cost = child->EvalCost();
+      return cost < 0 ? -1 : cost + (op != UnaryOP::PLUS);
+    }
 };
 
 class BinaryExpAST : public BaseAST {
@@ -1034,6 +1055,15 @@ class BinaryExpAST : public BaseAST {
           return lval % rval;    
       }
     }
+
+    // 除法很慢, 除数还可能是 0, 不提前求值
+    int EvalCost() const override {
+      int l = left->EvalCost(), r = right->EvalCost();
+      if (l < 0 || r < 0 || op == BinaryOP::DIV || op == BinaryOP::MOD) {
+        return -1;
+      }
+      return l + r + 1;
+    }
 };
 
 class RelExpAST : public BaseAST {
@@ -1117,8 +1147,16 @@ class RelExpAST : public BaseAST {
           return lval >= rval;  
       }
     }
+
+    int EvalCost() const override {
+      int l = left->EvalCost(), r = right->EvalCost();
+      return l < 0 || r < 0 ? -1 : l + r + 1;
+    }
 }; 
 
+// 短路求值的右边最多提前执行多少条指令, 超过时保留分支
+static const int kMaxSpeculatedCost = 4;
+
 class LogicalExpAST : public BaseAST {
   public:
     LogicalOP op;
@@ -1140,34 +1178,40 @@ class LogicalExpAST : public BaseAST {
       std::cout << id << "}\n";
     }
 
+    // 右边没有副作用并且足够便宜时, 两边都求值再用位运算合并, 省掉一次短路分支:
     // int 逻辑or  ->  两个数先or, 再判断结果是否 ne 0
     // int 逻辑and ->  两个数先ne 0, 再对两个结果and，最后即为结果
-    // std::string DumpIR(Environemt &env) const override {
-    //   std::string ret_code;
-    //   std::string left_var = left->DumpIR(env);
-    //   std::string right_var = right->DumpIR(env);
-    //   std::string ret_var = env.NewTempVar();
-    //   switch (op) {
-    //     case LogicalOP::OR: {
-    //       std::string r1 = env.NewTempVar();
-    //       ret_code += CodeGen::emitOr(r1, left_var, right_var);
-    //       ret_code += CodeGen::emitNe(ret_var, std::to_string(0), r1);
-    //       break;
-    //     }
-    //     case LogicalOP::AND: {
-    //       std::string r1 = env.NewTempVar();
-    //       std::string r2 = env.NewTempVar();
-    //       ret_code += CodeGen::emitNe(r1, std::to_string(0), left_var);
-    //       ret_code += CodeGen::emitNe(r2, std::to_string(0), right_var);
-    //       ret_code += CodeGen::emitAnd(ret_var, r1, r2);
-    //       break;
-    //     }
-    //   }
-    //   env.code << ret_code;
-    //   return ret_var;
-    // }
+    // 比较的结果本来就是 0/1, 多余的 ne 0 由后面的 IR 优化去掉. 链式的 && 和 || 递归处理
+    std::string DumpBitwiseIR(Environemt &env) const {
+      std::string ret_code;
+      std::string left_var = left->DumpIR(env);
+      std::string right_var = right->DumpIR(env);
+      std::string ret_var = env.NewTempVar();
+      switch (op) {
+        case LogicalOP::OR: {
+          std::string r1 = env.NewTempVar();
+          ret_code += CodeGen::emitOr(r1, left_var, right_var);
+          ret_code += CodeGen::emitNe(ret_var, std::to_string(0), r1);
+          break;
+        }
+        case LogicalOP::AND: {
+          std::string r1 = env.NewTempVar();
+          std::string r2 = env.NewTempVar();
+          ret_code += CodeGen::emitNe(r1, std::to_string(0), left_var);
+          ret_code += CodeGen::emitNe(r2, std::to_string(0), right_var);
+          ret_code += CodeGen::emitAnd(ret_var, r1, r2);
+          break;
+        }
+      }
+      env.code << ret_code;
+      return ret_var;
+    }
 
     std::string DumpIR(Environemt &env) const override {
+      int cost = right->EvalCost();
+      if (cost >= 0 && cost <= kMaxSpeculatedCost) {
+        return DumpBitwiseIR(env);
+      }
       std::string ret_var = env.NewTempVar();
       env.code << CodeGen::emitAlloc(ret_var, "i32");
       if (op == LogicalOP::OR) {
@@ -1214,5 +1258,14 @@ class LogicalExpAST : public BaseAST {
         }
       }
     }
+
+    // 整个表达式都按位运算求值时的代价, 用于链式的 && 和 ||
+    int EvalCost() const override {
+      int l = left->EvalCost(), r = right->EvalCost();
+      if (l < 0 || r < 0 || r > kMaxSpeculatedCost) {
+        return -1;
+      }
+      return l + r + 2;
+    }
 };
 
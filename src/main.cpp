@@ -1,5 +1,6 @@
 #include "ast.hpp"
 #include "koopa.h"
+#include "Passes.hpp"
 #include "RISCV.hpp"
 
 #include <cassert>
@@ -27,10 +28,17 @@ extern int yyparse(unique_ptr<BaseAST> &ast);
 int main(int argc, const char *argv[]) {
   // 解析命令行参数. 测试脚本/评测平台要求你的编译器能接收如下参数:
   // compiler 模式 输入文件 -o 输出文件
-  assert(argc == 5);
+  // 最后还可以加上 -mcpu=名字, 选择指令调度和 if-conversion 使用的延迟表 (见 cpu_models)
+  assert(argc == 5 || argc == 6);
   auto mode = argv[1];
   auto input = argv[2];
   auto output = argv[4];
+  string cpu = "generic";
+  if (argc == 6) {
+    string option = argv[5];
+    assert(option.rfind("-mcpu=", 0) == 0);
+    cpu = option.substr(6);
+  }
 
   // 打开输入文件, 并且指定 lexer 在解析的时候读取这个文件
   yyin = fopen(input, "r");
@@ -64,8 +72,14 @@ int main(int argc, const char *argv[]) {
     // 将 Koopa IR 程序转换为 raw program
     koopa_raw_program_t raw = koopa_build_raw_program(builder, program);
     RISCVEnvironemt env;
+    env.cpu = FindCpuModel(cpu);
+    assert(env.cpu);  // 不认识的 CPU
+    // 先在 raw program 上做与目标无关的优化, 优化新建的值放在 arena 里
+    IRArena arena;
+    OptimizeProgram(arena, raw, *env.cpu);
     Visit(env, raw);  
     fout << env.code.str();
+    env.peephole.Dump(cout);
     // 释放 Koopa IR 程序占用的内存
     koopa_delete_program(program);
   